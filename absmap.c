@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdint.h>
+
+#include "absmap.h"
+#include "config.h"
+#include "common.h"
+
+struct absmap_monitor {
+	/* rectangle on our synergy screen */
+	uint16_t src_x, src_y, src_w, src_h;
+	/* where it is on the target's virtual desktop, in target pixels */
+	uint16_t dst_x, dst_y, dst_w, dst_h;
+
+	/* precomputed: hid = off + (src - src_off) * mul >> 16 */
+	uint32_t off_x, off_y;
+	uint32_t mul_x, mul_y;
+};
+
+static struct absmap_monitor g_monitors[] = CONFIG_MONITORS;
+static struct absmap_monitor *g_last_monitor = &g_monitors[0];
+
+#define NUM_MONITORS (sizeof(g_monitors) / sizeof(g_monitors[0]))
+
+void
+absmap_init(void)
+{
+	uint32_t desktop_w = 1, desktop_h = 1;
+	unsigned i;
+
+	for (i = 0; i < NUM_MONITORS; i++) {
+		struct absmap_monitor *mon = &g_monitors[i];
+
+		if (mon->dst_x + mon->dst_w > desktop_w) {
+			desktop_w = mon->dst_x + mon->dst_w;
+		}
+		if (mon->dst_y + mon->dst_h > desktop_h) {
+			desktop_h = mon->dst_y + mon->dst_h;
+		}
+	}
+
+	for (i = 0; i < NUM_MONITORS; i++) {
+		struct absmap_monitor *mon = &g_monitors[i];
+
+		mon->off_x = (uint64_t)mon->dst_x * ABSMAP_HID_MAX / (desktop_w - 1);
+		mon->off_y = (uint64_t)mon->dst_y * ABSMAP_HID_MAX / (desktop_h - 1);
+		mon->mul_x = ((uint64_t)mon->dst_w * ABSMAP_HID_MAX << 16) /
+				((uint64_t)(desktop_w - 1) * mon->src_w);
+		mon->mul_y = ((uint64_t)mon->dst_h * ABSMAP_HID_MAX << 16) /
+				((uint64_t)(desktop_h - 1) * mon->src_h);
+
+		LOG(LOG_DEBUG_1, "monitor %u: %ux%u+%u+%u -> %ux%u+%u+%u of %ux%u",
+				i, mon->src_w, mon->src_h, mon->src_x, mon->src_y,
+				mon->dst_w, mon->dst_h, mon->dst_x, mon->dst_y,
+				desktop_w, desktop_h);
+	}
+}
+
+static struct absmap_monitor *
+find_monitor(uint16_t x, uint16_t y)
+{
+	unsigned i;
+
+	if ((uint16_t)(x - g_last_monitor->src_x) < g_last_monitor->src_w &&
+			(uint16_t)(y - g_last_monitor->src_y) < g_last_monitor->src_h) {
+		return g_last_monitor;
+	}
+
+	for (i = 0; i < NUM_MONITORS; i++) {
+		struct absmap_monitor *mon = &g_monitors[i];
+
+		if ((uint16_t)(x - mon->src_x) < mon->src_w &&
+				(uint16_t)(y - mon->src_y) < mon->src_h) {
+			g_last_monitor = mon;
+			return mon;
+		}
+	}
+
+	/* somewhere in between the monitors; stick to the last one */
+	return g_last_monitor;
+}
+
+static uint16_t
+map_axis(int32_t v, uint16_t src_off, uint16_t src_len, uint32_t off, uint32_t mul)
+{
+	uint32_t hid;
+
+	v -= src_off;
+	if (v < 0) {
+		v = 0;
+	} else if (v >= src_len) {
+		v = src_len - 1;
+	}
+
+	hid = off + (((uint64_t)v * mul) >> 16);
+	return hid > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : hid;
+}
+
+void
+absmap_point(uint16_t x, uint16_t y, uint16_t *hid_x, uint16_t *hid_y)
+{
+	struct absmap_monitor *mon = find_monitor(x, y);
+
+	*hid_x = map_axis(x, mon->src_x, mon->src_w, mon->off_x, mon->mul_x);
+	*hid_y = map_axis(y, mon->src_y, mon->src_h, mon->off_y, mon->mul_y);
+}
+
+/* the fractions of a HID unit (in 1/65536) not moved by yet, per axis */
+static uint32_t g_delta_rem_x, g_delta_rem_y;
+
+static int16_t
+scale_delta(int16_t d, uint32_t mul, uint32_t *rem)
+{
+	/* the shift rounds down, so carry what it drops to the next move
+	 * instead of drifting left and up */
+	int64_t scaled = (int64_t)d * mul + *rem;
+	int64_t hid = scaled >> 16;
+
+	if (hid > ABSMAP_HID_MAX) {
+		*rem = 0;
+		return ABSMAP_HID_MAX;
+	} else if (hid < -ABSMAP_HID_MAX) {
+		*rem = 0;
+		return -ABSMAP_HID_MAX;
+	}
+	*rem = scaled & 0xFFFF;
+	return hid;
+}
+
+void
+absmap_delta(int16_t dx, int16_t dy, int16_t *hid_dx, int16_t *hid_dy)
+{
+	*hid_dx = scale_delta(dx, g_last_monitor->mul_x, &g_delta_rem_x);
+	*hid_dy = scale_delta(dy, g_last_monitor->mul_y, &g_delta_rem_y);
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_ABSMAP
+#define SYNERGY_SERIAL_ABSMAP
+
+#include <stdint.h>
+
+/* HID logical range of the absolute mouse axes */
+#define ABSMAP_HID_MAX 32767
+
+/** Precompute the fixed-point multipliers for CONFIG_MONITORS */
+void absmap_init(void);
+/** Map a point on our synergy screen into the HID logical range */
+void absmap_point(uint16_t x, uint16_t y, uint16_t *hid_x, uint16_t *hid_y);
+/** Scale a relative move (in screen pixels) into HID logical units */
+void absmap_delta(int16_t dx, int16_t dy, int16_t *hid_dx, int16_t *hid_dy);
+
+#endif /* SYNERGY_SERIAL_ABSMAP */
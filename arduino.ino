@@ -2,80 +2,590 @@
  * Copyright(c) 2022 Darek Stojaczyk
  */
 
-#define SERIAL_RX_BUFFER_SIZE 16 * 8
-#define SERIAL_TX_BUFFER_SIZE 16 * 8
-
 #include "HID-Project.h"
+#include "serial_proto.h"
 
+/* The UART is driven directly instead of through Serial1: the rx interrupt
+ * parses the messages as the bytes come in and queues the complete ones,
+ * so nothing is lost while loop() is stuck sending a HID report. */
 struct serial_msg {
-	uint8_t tag[4];
-	uint16_t arg1;
-	uint16_t arg2;
+  uint8_t op;
+  uint8_t payload[SERIAL_MAX_PAYLOAD];
 };
 
-#define STR2TAG(str) *(uint32_t *)(str)
+/* the host never has more than 8 messages in flight */
+#define MSG_RING_SIZE 16
+static struct serial_msg msg_ring[MSG_RING_SIZE];
+static volatile uint8_t msg_head, msg_tail;
 
-void setup() {
-  Serial1.begin(115200);
+/* the message being received */
+static struct serial_msg rx_msg;
+static uint8_t rx_off, rx_len;
+static bool rx_in_msg;
+static unsigned long rx_byte_us, rx_gap_us;
 
-  /* dummy resolution -> we'll set up the proper one later */
-  AbsoluteMouse.begin(1920, 1080);
-  Keyboard.begin();
+/* bytes lost by the UART, invalid opcodes and messages with no room */
+static volatile uint32_t overruns;
+static uint32_t overruns_reported;
 
-  /* let them know we've reset / powered-on */
-  Serial1.write((uint8_t)0xFF);
+static const uint8_t op_len[] = {
+#define SERIAL_OP_LEN(name, len) len,
+  SERIAL_OPS(SERIAL_OP_LEN)
+#undef SERIAL_OP_LEN
+};
+
+static void
+msg_push(void)
+{
+  if ((uint8_t)(msg_head - msg_tail) == MSG_RING_SIZE) {
+    overruns++;
+    return;
+  }
+
+  msg_ring[msg_head % MSG_RING_SIZE] = rx_msg;
+  msg_head++;
 }
 
-struct serial_msg *
-read_msg(void)
+ISR(USART1_RX_vect)
 {
-  static struct serial_msg msg;
-  int off;
+  uint8_t status = UCSR1A;
+  uint8_t b = UDR1;
+  unsigned long now = micros();
+
+  if (rx_in_msg && now - rx_byte_us > rx_gap_us) {
+    /* the host paused mid-message: it was noise that started this one */
+    overruns++;
+    rx_in_msg = false;
+  }
+  rx_byte_us = now;
 
-  if (Serial1.available() < sizeof(msg)) {
-    return NULL;
+  if (status & _BV(FE1)) {
+    /* garbage, likely from the wrong baudrate; so is the rest of the message */
+    overruns++;
+    rx_in_msg = false;
+    return;
+  } else if (status & _BV(DOR1)) {
+    overruns++;
   }
 
-  off = 0;
-  while (off < sizeof(msg)) {
-    *(uint8_t *)((char *)(&msg) + off++) = Serial1.read();
+  if (!rx_in_msg) {
+    if (b >= SERIAL_OP_COUNT) {
+      overruns++;
+      return;
+    }
+    rx_msg.op = b;
+    rx_off = 0;
+    rx_len = op_len[b];
+    rx_in_msg = true;
+    if (rx_len == SERIAL_PAYLOAD_MASKED) {
+      /* just the bitmask for now */
+      rx_len = 1;
+    }
+  } else {
+    rx_msg.payload[rx_off++] = b;
+    if (rx_off == 1 && op_len[rx_msg.op] == SERIAL_PAYLOAD_MASKED) {
+      rx_len += __builtin_popcount(b);
+    }
   }
 
-  /* let them know we've consumed a packet and they can send a new one */
-  Serial1.write((uint8_t)0x1);
+  if (rx_off == rx_len) {
+    if (rx_msg.op == SERIAL_OP_PING) {
+      /* when it was received, for the PONG - there's room after the payload */
+      uint32_t now = micros();
+      memcpy(&rx_msg.payload[4], &now, sizeof(now));
+    }
+    msg_push();
+    rx_in_msg = false;
+  }
+}
 
-  return &msg;
+static void
+uart_begin(unsigned long baud)
+{
+  /* double speed, as Serial1.begin() would - 115200 is 2.1% off otherwise */
+  UCSR1A = _BV(U2X1);
+  UBRR1 = (F_CPU / 4 / baud - 1) / 2;
+  UCSR1C = _BV(UCSZ11) | _BV(UCSZ10); /* 8n1 */
+  UCSR1B = _BV(RXEN1) | _BV(TXEN1) | _BV(RXCIE1);
+  rx_gap_us = SERIAL_RESYNC_US + 20000000UL / baud;
 }
 
-void loop() {
-  struct serial_msg *msg;
-  uint32_t tag;
+static void
+uart_write(uint8_t b)
+{
+  while (!(UCSR1A & _BV(UDRE1)));
+  /* clear TXC1, so that uart_drain() knows when this one's out */
+  UCSR1A = (UCSR1A & _BV(U2X1)) | _BV(TXC1);
+  UDR1 = b;
+}
+
+/* wait until everything written is fully shifted out */
+static void
+uart_drain(void)
+{
+  while (!(UCSR1A & _BV(TXC1)));
+}
+
+/* see SERIAL_BAUD_TRIAL_MS and SERIAL_BAUD_IDLE_MS */
+static unsigned long uart_baud = SERIAL_BOOT_BAUDRATE, baud_prev;
+static bool baud_trial;
+static unsigned long baud_changed_ms, rx_last_ms;
+
+static void
+baud_set(unsigned long rate)
+{
+  uart_drain();
+  noInterrupts();
+  uart_begin(rate);
+  /* whatever was half received is garbage now */
+  rx_in_msg = false;
+  interrupts();
+  uart_baud = rate;
+  baud_changed_ms = millis();
+}
+
+static void
+baud_check(void)
+{
+  unsigned long now = millis();
+
+  if (baud_trial && now - baud_changed_ms > SERIAL_BAUD_TRIAL_MS) {
+    baud_trial = false;
+    baud_set(baud_prev);
+  } else if (uart_baud != SERIAL_BOOT_BAUDRATE && now - rx_last_ms > SERIAL_BAUD_IDLE_MS &&
+      now - baud_changed_ms > SERIAL_BAUD_IDLE_MS) {
+    baud_set(SERIAL_BOOT_BAUDRATE);
+  }
+}
+
+static uint16_t
+msg_arg(const struct serial_msg *msg, unsigned i)
+{
+  return msg->payload[i * 2] | (uint16_t)msg->payload[i * 2 + 1] << 8;
+}
+
+/* The host sends coordinates already scaled to the HID logical range
+ * (0-32767), so we fill the absolute mouse report ourselves instead of
+ * going through AbsoluteMouse and its per-move division.
+ *
+ * The handlers only update the reports, they're sent after all the queued
+ * messages are handled. Moves and scrolls just merge, but a report with
+ * a button or key change is sent before any conflicting change, so no
+ * click or keystroke is lost and the order across devices is kept. */
+static HID_MouseAbsoluteReport_Data_t mouse_report;
+static bool mouse_dirty, buttons_dirty;
+/* 1 if key presses are pending, -1 if releases, 0 if nothing */
+static int8_t keys_dir;
+/* relative mouse movement not sent yet; a report moves by 127 at most */
+static int16_t rel_dx, rel_dy;
+/* micros() after the last HID report went out, for the PONG */
+static uint32_t hid_sent_us;
+
+static void
+hid_sent(void)
+{
+  hid_sent_us = micros();
+}
+
+static void
+mouse_send(void)
+{
+  if (!mouse_dirty) {
+    return;
+  }
+
+  HID().SendReport(HID_REPORTID_MOUSE_ABSOLUTE, &mouse_report, sizeof(mouse_report));
+  hid_sent();
+  mouse_report.wheel = 0;
+  mouse_dirty = buttons_dirty = false;
+}
+
+static int8_t
+rel_take(int16_t *v)
+{
+  int8_t d = *v < -127 ? -127 : (*v > 127 ? 127 : *v);
+
+  *v -= d;
+  return d;
+}
+
+static void
+rel_send(void)
+{
+  HID_MouseReport_Data_t report = {};
+
+  while (rel_dx || rel_dy) {
+    report.xAxis = rel_take(&rel_dx);
+    report.yAxis = rel_take(&rel_dy);
+    HID().SendReport(HID_REPORTID_MOUSE, &report, sizeof(report));
+    hid_sent();
+  }
+}
+
+static void
+keys_send(void)
+{
+  if (!keys_dir) {
+    return;
+  }
+
+  Keyboard.send();
+  hid_sent();
+  keys_dir = 0;
+}
+
+static void
+buttons_change(void)
+{
+  /* clicks where the pointer was moved to */
+  rel_send();
+  if (keys_dir) {
+    keys_send();
+  }
+  if (buttons_dirty) {
+    mouse_send();
+  }
+  mouse_dirty = buttons_dirty = true;
+}
+
+static void
+keys_change(int8_t dir)
+{
+  if (buttons_dirty) {
+    mouse_send();
+  }
+  if (keys_dir && keys_dir != dir) {
+    keys_send();
+  }
+  keys_dir = dir;
+}
+
+static int16_t
+mouse_clamp(int32_t v)
+{
+  return v < 0 ? 0 : (v > 32767 ? 32767 : v);
+}
+
+static int16_t
+rel_clamp(int32_t v)
+{
+  return v < -32767 ? -32767 : (v > 32767 ? 32767 : v);
+}
+
+static int8_t
+wheel_clamp(int16_t v)
+{
+  return v < -127 ? -127 : (v > 127 ? 127 : v);
+}
+
+/* key being auto-repeated (KRPT), 0 if none */
+static uint16_t repeat_key;
+static uint16_t repeat_interval_ms;
+static unsigned long repeat_last_ms;
+/* tracked so that horizontal scroll doesn't mess with a user-held shift */
+static bool lshift_held;
+
+static void
+repeat_stop(void)
+{
+  repeat_key = 0;
+}
+
+static void
+repeat_kick(void)
+{
+  unsigned long now = millis();
+
+  if (!repeat_key || now - repeat_last_ms < repeat_interval_ms) {
+    return;
+  }
+
+  repeat_last_ms = now;
+  Keyboard.release(KeyboardKeycode(repeat_key));
+  Keyboard.press(KeyboardKeycode(repeat_key));
+  hid_sent();
+}
+
+static void
+handle_SCFG(const struct serial_msg *msg)
+{
+  /* nothing to scale on our side anymore */
+}
+
+static void
+handle_MMOV(const struct serial_msg *msg)
+{
+  mouse_report.xAxis = mouse_clamp((int32_t)mouse_report.xAxis + (int16_t)msg_arg(msg, 0));
+  mouse_report.yAxis = mouse_clamp((int32_t)mouse_report.yAxis + (int16_t)msg_arg(msg, 1));
+  mouse_dirty = true;
+}
+
+static void
+handle_MSET(const struct serial_msg *msg)
+{
+  mouse_report.xAxis = msg_arg(msg, 0);
+  mouse_report.yAxis = msg_arg(msg, 1);
+  mouse_dirty = true;
+}
+
+static void
+handle_MBDN(const struct serial_msg *msg)
+{
+  buttons_change();
+  mouse_report.buttons |= msg_arg(msg, 0);
+}
+
+static void
+handle_MBUP(const struct serial_msg *msg)
+{
+  buttons_change();
+  mouse_report.buttons &= ~msg_arg(msg, 0);
+}
+
+static void
+handle_MWHL(const struct serial_msg *msg)
+{
+  int16_t horizontal = msg_arg(msg, 0);
+  int16_t vertical = msg_arg(msg, 1);
+
+  if (vertical) {
+    mouse_report.wheel = wheel_clamp(mouse_report.wheel + vertical);
+    mouse_dirty = true;
+  }
+
+  if (horizontal) {
+    /* there's no horizontal wheel in the absolute mouse report, but
+     * shift + wheel scrolls horizontally pretty much everywhere */
+    keys_send();
+    mouse_send();
+    if (!lshift_held) {
+      Keyboard.press(KEY_LEFT_SHIFT);
+    }
+    mouse_report.wheel = wheel_clamp(-horizontal);
+    mouse_dirty = true;
+    mouse_send();
+    if (!lshift_held) {
+      Keyboard.release(KEY_LEFT_SHIFT);
+      hid_sent();
+    }
+  }
+}
+
+static void
+handle_KBDN(const struct serial_msg *msg)
+{
+  uint16_t key = msg_arg(msg, 0);
+
+  /* just like a real keyboard - only the last pressed key repeats */
+  repeat_stop();
+  if (key == KEY_LEFT_SHIFT) {
+    lshift_held = true;
+  }
+  keys_change(1);
+  Keyboard.add(KeyboardKeycode(key));
+}
+
+static void
+handle_KBUP(const struct serial_msg *msg)
+{
+  uint16_t key = msg_arg(msg, 0);
+
+  if (key == repeat_key) {
+    repeat_stop();
+  }
+  if (key == KEY_LEFT_SHIFT) {
+    lshift_held = false;
+  }
+  keys_change(-1);
+  Keyboard.remove(KeyboardKeycode(key));
+}
+
+static void
+handle_KRPT(const struct serial_msg *msg)
+{
+  repeat_key = msg_arg(msg, 0);
+  repeat_interval_ms = msg_arg(msg, 1);
+  /* the first repeat goes out right away */
+  repeat_last_ms = millis() - repeat_interval_ms;
+}
+
+static void
+handle_LEAV(const struct serial_msg *msg)
+{
+  repeat_stop();
+  lshift_held = false;
+  keys_send();
+  mouse_send();
+  mouse_report.buttons = 0;
+  mouse_dirty = buttons_dirty = true;
+  Keyboard.removeAll();
+  keys_dir = -1;
+}
+
+/* Raw reports from the host. Sent right away, as each is a separate state
+ * the host wants seen, but after anything still pending from the other
+ * messages. */
+static uint8_t keys_report[8];
+
+static void
+report_patch(uint8_t *report, unsigned len, const struct serial_msg *msg)
+{
+  const uint8_t *b = &msg->payload[1];
+  uint8_t mask = msg->payload[0];
+  unsigned i;
+
+  for (i = 0; i < len; i++) {
+    if (mask & (1 << i)) {
+      report[i] = *b++;
+    }
+  }
+}
+
+static void
+handle_KREP(const struct serial_msg *msg)
+{
+  rel_send();
+  keys_send();
+  mouse_send();
+  report_patch(keys_report, sizeof(keys_report), msg);
+  HID().SendReport(HID_REPORTID_KEYBOARD, keys_report, sizeof(keys_report));
+  hid_sent();
+}
+
+static void
+handle_MREP(const struct serial_msg *msg)
+{
+  rel_send();
+  keys_send();
+  mouse_send();
+  report_patch((uint8_t *)&mouse_report, sizeof(mouse_report), msg);
+  mouse_dirty = true;
+  mouse_send();
+}
 
-  msg = read_msg();
-  if (!msg) {
+static void
+uart_write32(uint32_t val)
+{
+  unsigned i;
+
+  for (i = 0; i < 4; i++) {
+    uart_write(val >> (i * 8));
+  }
+}
+
+/* Answered right away, so the host can tell the time spent in our queue
+ * from the time on the wire. It's all in our micros(), the host works out
+ * the offset to its clock. */
+static void
+handle_PING(const struct serial_msg *msg)
+{
+  uint32_t rx_us;
+
+  memcpy(&rx_us, &msg->payload[4], sizeof(rx_us));
+  uart_write(SERIAL_UP_PONG);
+  uart_write32(msg_arg(msg, 0) | (uint32_t)msg_arg(msg, 1) << 16);
+  uart_write32(rx_us);
+  uart_write32(micros());
+  uart_write32(hid_sent_us);
+}
+
+static void
+handle_BAUD(const struct serial_msg *msg)
+{
+  unsigned long rate = msg_arg(msg, 0) | (unsigned long)msg_arg(msg, 1) << 16;
+
+  if (rate == uart_baud) {
+    /* it works for the host too */
+    baud_trial = false;
+    return;
+  } else if (rate < 1200) {
     return;
   }
 
-  tag = STR2TAG(msg->tag);
-
-  if (tag == STR2TAG("SCFG")) {
-    AbsoluteMouse.begin(msg->arg1, msg->arg2);
-  } else if (tag == STR2TAG("MMOV")) {
-    AbsoluteMouse.move((int16_t)msg->arg1, (int16_t)msg->arg2);
-  } else if (tag == STR2TAG("MSET")) {
-    AbsoluteMouse.moveTo(msg->arg1, msg->arg2, 0);
-  } else if (tag == STR2TAG("MBDN")) {
-    AbsoluteMouse.press(msg->arg1);
-  } else if (tag == STR2TAG("MBUP")) {
-    AbsoluteMouse.release(msg->arg1);
-  } else if (tag == STR2TAG("MWHL")) {
-    AbsoluteMouse.move(0, 0, (int16_t)msg->arg2);
-  } else if (tag == STR2TAG("KBDN")) {
-    Keyboard.press(KeyboardKeycode(msg->arg1));
-  } else if (tag == STR2TAG("KBUP")) {
-    Keyboard.release(KeyboardKeycode(msg->arg1));
-  } else if (tag == STR2TAG("LEAV")) {
-    AbsoluteMouse.release(0xFF);
-    Keyboard.releaseAll();
+  /* the ack is already on its way at the old rate */
+  baud_prev = uart_baud;
+  baud_trial = true;
+  baud_set(rate);
+}
+
+static void
+handle_ECHO(const struct serial_msg *msg)
+{
+  unsigned i;
+
+  uart_write(SERIAL_UP_ECHO);
+  for (i = 0; i < 8; i++) {
+    uart_write(msg->payload[i]);
+  }
+}
+
+static void
+handle_RMOV(const struct serial_msg *msg)
+{
+  /* a click queued before it stays before it */
+  if (buttons_dirty) {
+    mouse_send();
   }
+  rel_dx = rel_clamp((int32_t)rel_dx + (int16_t)msg_arg(msg, 0));
+  rel_dy = rel_clamp((int32_t)rel_dy + (int16_t)msg_arg(msg, 1));
+}
+
+static void (*const op_handlers[])(const struct serial_msg *) = {
+#define SERIAL_OP_HANDLER(name, len) handle_##name,
+  SERIAL_OPS(SERIAL_OP_HANDLER)
+#undef SERIAL_OP_HANDLER
+};
+
+static void
+overruns_report(void)
+{
+  uint32_t count;
+
+  noInterrupts();
+  count = overruns;
+  interrupts();
+
+  if (count == overruns_reported) {
+    return;
+  }
+
+  overruns_reported = count;
+  uart_write(SERIAL_UP_OVERRUNS);
+  uart_write32(count);
+}
+
+void setup() {
+  uart_begin(SERIAL_BOOT_BAUDRATE);
+
+  /* just registers the HID descriptor, we send the reports directly */
+  AbsoluteMouse.begin(1920, 1080);
+  Mouse.begin();
+  Keyboard.begin();
+
+  /* let them know we've reset / powered-on */
+  uart_write(SERIAL_UP_RESET);
+}
+
+void loop() {
+  repeat_kick();
+  baud_check();
+
+  while (msg_tail != msg_head) {
+    struct serial_msg *msg = &msg_ring[msg_tail % MSG_RING_SIZE];
+
+    rx_last_ms = millis();
+
+    /* let them know we've consumed a message and they can send a new one;
+     * the ring has room for more than they can have in flight */
+    uart_write(SERIAL_UP_ACK);
+
+    /* the opcode was checked by the interrupt already */
+    op_handlers[msg->op](msg);
+    msg_tail++;
+  }
+
+  rel_send();
+  keys_send();
+  mouse_send();
+  overruns_report();
 }
@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+/* Drives many independent connections through the protocol core in one
+ * process, all from the same recorded stream (see --record), like a
+ * multiplexer would. Each one gets its own sink that just hashes what it's
+ * given, and they're all checked to have decoded the same in the end.
+ *
+ *   ./build/bench-conns [-n nconns] [-s split_bytes] build/workload.bin
+ *
+ * -s pushes each recorded chunk in pieces of that many bytes, to exercise
+ * the reassembly of packets split between pushes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "synergy_proto.h"
+#include "sink.h"
+#include "common.h"
+#include "config.h"
+
+struct bench_conn {
+	struct synergy_proto_conn conn;
+	struct sink sink;
+	uint64_t nevents;
+	uint64_t hash; /**< of all the events, in order */
+	uint64_t nresp_bytes;
+};
+
+struct chunk {
+	uint64_t ts_us;
+	const char *buf;
+	uint32_t len;
+};
+
+static int
+bench_event(struct sink *sink, uint64_t type, uint64_t arg1, uint64_t arg2)
+{
+	struct bench_conn *bconn = (struct bench_conn *)((char *)sink -
+			offsetof(struct bench_conn, sink));
+	uint64_t v = type << 48 | (arg1 & 0xFFFF) << 16 | (arg2 & 0xFFFF);
+
+	bconn->nevents++;
+	bconn->hash = (bconn->hash ^ v) * 0x100000001b3ULL;
+	return 0;
+}
+
+static int
+bench_sink_move(struct sink *sink, int16_t dx, int16_t dy)
+{
+	return bench_event(sink, SINK_EV_MOVE, dx, dy);
+}
+
+static int
+bench_sink_set_pos(struct sink *sink, uint16_t x, uint16_t y)
+{
+	return bench_event(sink, SINK_EV_SET_POS, x, y);
+}
+
+static int
+bench_sink_button(struct sink *sink, uint8_t id, bool down)
+{
+	return bench_event(sink, SINK_EV_BUTTON, id, down);
+}
+
+static int
+bench_sink_wheel(struct sink *sink, int16_t dx, int16_t dy)
+{
+	return bench_event(sink, SINK_EV_WHEEL, dx, dy);
+}
+
+static int
+bench_sink_key(struct sink *sink, uint16_t id, bool down)
+{
+	return bench_event(sink, SINK_EV_KEY, id, down);
+}
+
+static int
+bench_sink_key_repeat(struct sink *sink, uint16_t id)
+{
+	return bench_event(sink, SINK_EV_KEY_REPEAT, id, 0);
+}
+
+static int
+bench_sink_release_all(struct sink *sink)
+{
+	return bench_event(sink, SINK_EV_RELEASE_ALL, 0, 0);
+}
+
+static int
+bench_sink_flush(struct sink *sink)
+{
+	return 0;
+}
+
+static const struct sink_ops g_bench_sink_ops = {
+	.move = bench_sink_move,
+	.set_pos = bench_sink_set_pos,
+	.button = bench_sink_button,
+	.wheel = bench_sink_wheel,
+	.key = bench_sink_key,
+	.key_repeat = bench_sink_key_repeat,
+	.release_all = bench_sink_release_all,
+	.flush = bench_sink_flush,
+};
+
+static ssize_t
+bench_send(struct synergy_proto_conn *conn, const void *buf, size_t len)
+{
+	struct bench_conn *bconn = conn->ctx;
+
+	bconn->nresp_bytes += len;
+	return len;
+}
+
+/* the whole recording in memory, split into its chunks */
+static struct chunk *
+load_chunks(const char *path, unsigned *nchunks)
+{
+	struct chunk *chunks = NULL;
+	unsigned n = 0, cap = 0;
+	size_t size = 0, off = 0;
+	char *data = NULL;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "can't open \"%s\": %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	while (1) {
+		data = realloc(data, size + 1024 * 1024);
+		size_t rc = fread(data + size, 1, 1024 * 1024, file);
+
+		size += rc;
+		if (rc < 1024 * 1024) {
+			break;
+		}
+	}
+	fclose(file);
+
+	while (off + 12 <= size) {
+		uint64_t ts_us;
+		uint32_t len;
+
+		memcpy(&ts_us, data + off, 8);
+		memcpy(&len, data + off + 8, 4);
+		ts_us = be64toh(ts_us);
+		len = be32toh(len);
+		off += 12;
+		if (len == 0 || off + len > size) {
+			break;
+		}
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 4096;
+			chunks = realloc(chunks, cap * sizeof(*chunks));
+		}
+		chunks[n++] = (struct chunk){ ts_us, data + off, len };
+		off += len;
+	}
+
+	if (off != size || n == 0) {
+		fprintf(stderr, "\"%s\" is corrupted\n", path);
+		return NULL;
+	}
+
+	*nchunks = n;
+	return chunks;
+}
+
+static int
+push(struct bench_conn *bconn, const struct chunk *chunk, unsigned split)
+{
+	unsigned off, n;
+	int rc;
+
+	for (off = 0; off < chunk->len; off += n) {
+		n = chunk->len - off < split ? chunk->len - off : split;
+		rc = synergy_proto_push(&bconn->conn, chunk->buf + off, n);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_conn *bconns;
+	struct chunk *chunks;
+	unsigned nconns = 1000, split = UINT32_MAX;
+	unsigned nchunks, i, c;
+	uint64_t next_tick_us, start_us, elapsed_us, npkts = 0;
+	int opt, rc;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		if (opt == 'n') {
+			nconns = atoi(optarg);
+		} else if (opt == 's') {
+			split = atoi(optarg);
+		} else {
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || nconns == 0 || split == 0) {
+		fprintf(stderr, "%s [-n nconns] [-s split_bytes] /path/to/stream.bin\n", argv[0]);
+		return 1;
+	}
+
+	/* the greetings and such, times nconns */
+	g_log_level = LOG_ERROR;
+
+	chunks = load_chunks(argv[optind], &nchunks);
+	if (!chunks) {
+		return 1;
+	}
+
+	bconns = calloc(nconns, sizeof(*bconns));
+	if (!bconns) {
+		fprintf(stderr, "can't allocate %u connections\n", nconns);
+		return 1;
+	}
+
+	for (i = 0; i < nconns; i++) {
+		struct bench_conn *bconn = &bconns[i];
+
+		bconn->sink.name = "bench";
+		bconn->sink.ops = &g_bench_sink_ops;
+		bconn->conn.sink = &bconn->sink;
+		bconn->conn.send = bench_send;
+		bconn->conn.ctx = bconn;
+	}
+
+	/* one chunk to every connection, then the next one */
+	next_tick_us = CONFIG_SERIAL_MOUSE_INTERVAL_MS * 1000;
+	start_us = get_monotonic_us();
+	for (c = 0; c < nchunks; c++) {
+		while (chunks[c].ts_us >= next_tick_us) {
+			for (i = 0; i < nconns; i++) {
+				sink_flush(&bconns[i].sink);
+			}
+			next_tick_us += CONFIG_SERIAL_MOUSE_INTERVAL_MS * 1000;
+		}
+
+		for (i = 0; i < nconns; i++) {
+			rc = push(&bconns[i], &chunks[c], split);
+			if (rc < 0) {
+				fprintf(stderr, "connection %u: push returned %d\n", i, rc);
+				return 1;
+			}
+		}
+	}
+	elapsed_us = get_monotonic_us() - start_us;
+
+	for (i = 0; i < nconns; i++) {
+		struct bench_conn *bconn = &bconns[i];
+
+		if (bconn->conn.npkts != bconns[0].conn.npkts ||
+				bconn->nevents != bconns[0].nevents ||
+				bconn->hash != bconns[0].hash ||
+				bconn->nresp_bytes != bconns[0].nresp_bytes) {
+			fprintf(stderr, "connection %u decoded something else than the first one\n", i);
+			return 1;
+		}
+		npkts += bconn->conn.npkts;
+	}
+
+	printf("%u connections, %zu bytes each: %"PRIu64" packets in %"PRIu64" us "
+			"(%"PRIu64" ns per packet)\n", nconns, sizeof(*bconns), npkts, elapsed_us,
+			npkts ? elapsed_us * 1000 / npkts : 0);
+	printf("each: %"PRIu64" packets, %"PRIu64" events out (hash %016"PRIx64"), "
+			"%"PRIu64" response bytes\n", bconns[0].conn.npkts, bconns[0].nevents,
+			bconns[0].hash, bconns[0].nresp_bytes);
+	return 0;
+}
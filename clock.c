@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "common.h"
+
+bool g_clock_simulated;
+static uint64_t g_sim_now_us;
+
+void
+clock_sim_init(void)
+{
+	g_sim_now_us = get_monotonic_us();
+	g_clock_simulated = true;
+}
+
+void
+clock_sim_advance_to(uint64_t us)
+{
+	if (us > g_sim_now_us) {
+		g_sim_now_us = us;
+	}
+}
+
+uint64_t
+clock_now_us(void)
+{
+	if (g_clock_simulated) {
+		return g_sim_now_us;
+	}
+
+	return get_monotonic_us();
+}
+
+uint64_t
+clock_now_ns(void)
+{
+	struct timespec ts;
+
+	if (g_clock_simulated) {
+		return g_sim_now_us * 1000;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+clock_sleep_us(uint64_t us)
+{
+	if (g_clock_simulated) {
+		g_sim_now_us += us;
+		return;
+	}
+
+	usleep(us);
+}
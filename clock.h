@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_CLOCK
+#define SYNERGY_SERIAL_CLOCK
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* All timestamps and sleeps go through here. With the simulated clock the
+ * time only moves when clock_sleep_us() or clock_sim_advance_to() says so,
+ * so replays run as fast as the CPU allows and give the same numbers on
+ * every run. */
+extern bool g_clock_simulated;
+
+/** Switch to the simulated clock, starting at the current real time */
+void clock_sim_init(void);
+/** Move the simulated clock forward; never backwards */
+void clock_sim_advance_to(uint64_t us);
+
+uint64_t clock_now_us(void);
+uint64_t clock_now_ns(void);
+void clock_sleep_us(uint64_t us);
+
+#endif /* SYNERGY_SERIAL_CLOCK */
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "common.h"
 
@@ -50,4 +52,13 @@ slog(int type, const char *filename, unsigned lineno, const char *fnname, const
 
 	putc('\n', stderr);
 	fflush(stderr);
-}
\ No newline at end of file
+}
+
+uint64_t
+get_monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
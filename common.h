@@ -5,6 +5,8 @@
 #ifndef SYNERGY_SERIAL_COMMON
 #define SYNERGY_SERIAL_COMMON
 
+#include <stdint.h>
+
 enum {
     LOG_ERROR  = 0,
     LOG_INFO = 1,
@@ -18,4 +20,6 @@ extern int g_log_level;
 void slog(int type, const char *filename, unsigned lineno, const char *fnname, const char *fmt, ...);
 #define LOG(type, ...) slog((type), __FILE__, __LINE__, __func__, __VA_ARGS__)
 
+uint64_t get_monotonic_us(void);
+
 #endif /* SYNERGY_SERIAL_COMMON */
\ No newline at end of file
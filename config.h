@@ -10,7 +10,42 @@
 #define CONFIG_SCREENY 0
 #define CONFIG_SCREENW (1920 * 2)
 #define CONFIG_SCREENH 1080
+/* Target monitors, each as { src_x, src_y, src_w, src_h, dst_x, dst_y,
+ * dst_w, dst_h }: a rectangle of our synergy screen and where it lands on
+ * the target's virtual desktop (in target pixels). E.g. for two 1920x1080
+ * monitors stacked vertically on the target:
+ * { { 0, 0, 1920, 1080, 0, 0, 1920, 1080 },
+ *   { 1920, 0, 1920, 1080, 0, 1080, 1920, 1080 } }
+ */
+#define CONFIG_MONITORS \
+	{ { 0, 0, CONFIG_SCREENW, CONFIG_SCREENH, 0, 0, CONFIG_SCREENW, CONFIG_SCREENH } }
 #define CONFIG_SERIAL_TX_SIZE 8
+#define CONFIG_SINK_BATCH_SIZE 256
 #define CONFIG_SERIAL_MOUSE_INTERVAL_MS 16
+#define CONFIG_SERIAL_ACK_TIMEOUT_MS 500
+#define CONFIG_SERIAL_PING_INTERVAL_MS 1000
+/* tried in order when no baudrate is given, see SERIAL_BOOT_BAUDRATE */
+#define CONFIG_SERIAL_BAUDRATES 250000, 500000, 1000000, 2000000
+/* test pattern messages bounced off the firmware at each rate */
+#define CONFIG_SERIAL_PROBE_ECHOES 64
+#define CONFIG_SERIAL_PROBE_TIMEOUT_MS 100
+/* mouse moves and scrolls are held back while the kernel has more than
+ * this much queued for the wire (see --txq-budget) */
+#define CONFIG_SERIAL_TXQ_BUDGET_US 2000
+/* records in the --tap ring, a power of two */
+#define CONFIG_TAP_RECORDS (64 * 1024)
+#define CONFIG_KEY_REPEAT_INTERVAL_MS 33
+#define CONFIG_WHEEL_DELTA_PER_NOTCH 120
+#define CONFIG_HIDG_DEVPATH "/dev/hidg0"
+#define CONFIG_HIDG_WRITE_TIMEOUT_MS 100
+#define CONFIG_SIMLINK_LOOP_COST_US 40
+#define CONFIG_SIMLINK_HID_COST_US 1000
+#define CONFIG_BUSY_POLL_SOCK_US 50
+/* with --realtime, the busy poll sleeps this long every half of
+ * CONFIG_RT_WATCHDOG_MS, as only sleeping resets the watchdog */
+#define CONFIG_BUSY_POLL_NAP_US 100
+#define CONFIG_RT_DEFAULT_PRIO 50
+#define CONFIG_RT_WATCHDOG_MS 500
+#define CONFIG_RT_PREFAULT_STACK_SIZE (256 * 1024)
 
 #endif /* SYNERGY_SERIAL_CONFIG */
\ No newline at end of file
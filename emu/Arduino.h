@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+/* Just enough of the Arduino core and the ATmega32U4 USART1 registers to
+ * build arduino.ino on Linux. See emu.cpp for the UART and timing model
+ * behind it.
+ */
+
+#ifndef SYNERGY_SERIAL_EMU_ARDUINO
+#define SYNERGY_SERIAL_EMU_ARDUINO
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define F_CPU 16000000UL
+#define _BV(bit) (1 << (bit))
+
+unsigned long millis(void);
+unsigned long micros(void);
+
+/* the emulator runs the interrupt handlers whenever emulated time passes,
+ * there's no real concurrency */
+static inline void noInterrupts(void) { }
+static inline void interrupts(void) { }
+
+#define ISR(vect) extern "C" void vect(void)
+/** Called for each received byte, once it's fully shifted in */
+#define USART1_RX_vect emu_usart1_rx_isr
+
+#define U2X1 1
+#define DOR1 3
+#define FE1 4
+#define UDRE1 5
+#define TXC1 6
+#define TXEN1 3
+#define RXEN1 4
+#define RXCIE1 7
+#define UCSZ10 1
+#define UCSZ11 2
+
+/** Reads the last received byte, writes send one */
+class EmuUDR {
+public:
+	operator uint8_t() const;
+	EmuUDR &operator=(uint8_t b);
+};
+
+/** The tx side is always done; the rx error flags are for the last
+ * received byte */
+class EmuUCSRA {
+public:
+	operator uint8_t() const;
+	EmuUCSRA &operator=(uint8_t v) { return *this; }
+};
+
+extern EmuUDR UDR1;
+extern EmuUCSRA UCSR1A;
+extern uint8_t UCSR1B, UCSR1C;
+extern uint16_t UBRR1;
+
+/** Called by emulated HID devices whenever they'd submit a report */
+void emu_hid_report(const char *dev, const void *data, unsigned len);
+
+#endif /* SYNERGY_SERIAL_EMU_ARDUINO */
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+/* Stub HID-Project that records the reports it would send over USB */
+
+#ifndef SYNERGY_SERIAL_EMU_HID_PROJECT
+#define SYNERGY_SERIAL_EMU_HID_PROJECT
+
+#include "Arduino.h"
+#include "../arduino_keylayout.h"
+
+#define HID_REPORTID_MOUSE 1
+#define HID_REPORTID_KEYBOARD 2
+#define HID_REPORTID_MOUSE_ABSOLUTE 7
+
+typedef struct __attribute__((packed)) {
+	uint8_t buttons;
+	int8_t xAxis;
+	int8_t yAxis;
+	int8_t wheel;
+} HID_MouseReport_Data_t;
+
+typedef struct __attribute__((packed)) {
+	uint8_t buttons;
+	int16_t xAxis;
+	int16_t yAxis;
+	int8_t wheel;
+} HID_MouseAbsoluteReport_Data_t;
+
+class EmuHID {
+public:
+	int SendReport(uint8_t id, const void *data, int len)
+	{
+		emu_hid_report(id == HID_REPORTID_MOUSE_ABSOLUTE ? "mouse_abs" :
+				id == HID_REPORTID_MOUSE ? "mouse_rel" :
+				id == HID_REPORTID_KEYBOARD ? "keyboard" : "raw", data, len);
+		return len;
+	}
+};
+
+static inline EmuHID &
+HID(void)
+{
+	static EmuHID hid;
+	return hid;
+}
+
+class EmuAbsoluteMouse {
+public:
+	void begin(int w = 0, int h = 0) { }
+	void moveTo(int x, int y, signed char wheel = 0)
+	{
+		m_report.xAxis = x;
+		m_report.yAxis = y;
+		m_report.wheel = wheel;
+		send();
+	}
+	void move(int x, int y, signed char wheel = 0) { moveTo(m_report.xAxis + x, m_report.yAxis + y, wheel); }
+	void press(uint8_t b) { m_report.buttons |= b; send(); }
+	void release(uint8_t b) { m_report.buttons &= ~b; send(); }
+
+private:
+	void send(void) { emu_hid_report("mouse_abs", &m_report, sizeof(m_report)); }
+	HID_MouseAbsoluteReport_Data_t m_report = {};
+};
+
+class EmuMouse {
+public:
+	void begin(void) { }
+};
+
+class EmuKeyboard {
+public:
+	void begin(void) { }
+
+	/* add() and remove() only change the report, send() submits it */
+	size_t add(KeyboardKeycode k)
+	{
+		unsigned i;
+
+		if (k >= KEY_LEFT_CTRL && k <= KEY_RIGHT_GUI) {
+			m_report[0] |= 1 << (k - KEY_LEFT_CTRL);
+			return 1;
+		}
+
+		for (i = 2; i < sizeof(m_report); i++) {
+			if (m_report[i] == k) {
+				return 1;
+			}
+		}
+		for (i = 2; i < sizeof(m_report) && m_report[i] != 0; i++);
+		if (i == sizeof(m_report)) {
+			return 0;
+		}
+		m_report[i] = k;
+		return 1;
+	}
+
+	size_t remove(KeyboardKeycode k)
+	{
+		unsigned i;
+
+		if (k >= KEY_LEFT_CTRL && k <= KEY_RIGHT_GUI) {
+			m_report[0] &= ~(1 << (k - KEY_LEFT_CTRL));
+			return 1;
+		}
+
+		for (i = 2; i < sizeof(m_report); i++) {
+			if (m_report[i] == k) {
+				m_report[i] = 0;
+			}
+		}
+		return 1;
+	}
+
+	void removeAll(void) { memset(m_report, 0, sizeof(m_report)); }
+
+	size_t press(KeyboardKeycode k)
+	{
+		if (!add(k)) {
+			return 0;
+		}
+		send();
+		return 1;
+	}
+
+	size_t release(KeyboardKeycode k)
+	{
+		remove(k);
+		send();
+		return 1;
+	}
+
+	void releaseAll(void)
+	{
+		removeAll();
+		send();
+	}
+
+	void send(void) { emu_hid_report("keyboard", m_report, sizeof(m_report)); }
+
+private:
+	uint8_t m_report[8] = {};
+};
+
+extern EmuAbsoluteMouse AbsoluteMouse;
+extern EmuMouse Mouse;
+extern EmuKeyboard Keyboard;
+
+#endif /* SYNERGY_SERIAL_EMU_HID_PROJECT */
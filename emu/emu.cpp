@@ -0,0 +1,492 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+/* Runs arduino.ino on Linux, attached to a pseudo-terminal.
+ *
+ * Bytes written by the host to the pty are timestamped on arrival and
+ * "shifted in" one at a time at the modelled baudrate. Only then the
+ * sketch's USART1 rx interrupt handler is called for each, at the first
+ * opportunity - that's whenever emulated time passes: between loop()
+ * iterations and while the sketch is charged its fixed costs, for each
+ * loop() iteration that handled data (i.e. acked something) and for each
+ * HID report. All reports are optionally recorded to a file.
+ *
+ * The bytes go at the rate the host set on the pty. If the sketch's UART is
+ * set to a different one (more than 3% off), they come out as framing
+ * errors, both ways. Above the -b rate, as if the USB-serial adapter
+ * couldn't quite do it, every 64th byte gets a bit flipped. SIGUSR2 halves
+ * that rate, for a link going bad mid-session.
+ *
+ * SIGUSR1 resets the board: the emulator re-executes itself on the same pty,
+ * so the sketch starts from scratch and whatever was on the wire is lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <asm/ioctls.h>
+
+/* from asm/termbits.h, which can't be included along with termios.h */
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+
+#include "Arduino.h"
+#include "HID-Project.h"
+
+extern "C" void USART1_RX_vect(void);
+
+void setup(void);
+void loop(void);
+
+EmuUDR UDR1;
+EmuUCSRA UCSR1A;
+uint8_t UCSR1B, UCSR1C;
+uint16_t UBRR1;
+EmuAbsoluteMouse AbsoluteMouse;
+EmuMouse Mouse;
+EmuKeyboard Keyboard;
+
+static struct {
+	volatile unsigned max_baudrate;
+	unsigned loop_cost_us;
+	unsigned hid_cost_us;
+	const char *report_path;
+	const char *link_path;
+	int master_fd; /**< inherited across a reset */
+} g_args = { 2000000, 40, 1000, NULL, NULL, -1 };
+
+static volatile sig_atomic_t g_stop;
+static volatile sig_atomic_t g_reset;
+static int g_master_fd;
+static FILE *g_report_file;
+static uint64_t g_start_us;
+
+/* bytes on the wire, not shifted in yet */
+static struct {
+	uint64_t done_us;
+	uint8_t byte;
+	uint8_t status; /**< UCSR1A error bits */
+} g_wire[65536];
+static unsigned g_wire_head, g_wire_tail;
+static uint64_t g_wire_last_done_ns;
+static pthread_mutex_t g_wire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* what UDR1 and UCSR1A read */
+static uint8_t g_udr;
+static uint8_t g_rx_status;
+static bool g_loop_consumed;
+
+enum link_state {
+	LINK_OK,
+	LINK_NOISY,
+	LINK_MISMATCH,
+};
+static unsigned g_noise_count;
+
+static struct {
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t loops_consumed;
+	uint64_t reports;
+	uint64_t isr_wait_sum_us;
+	uint64_t isr_wait_max_us;
+	uint64_t bad_bytes;
+} g_stats;
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void serial_sync(void);
+
+static unsigned
+host_baudrate(void)
+{
+	struct termios2 tty;
+
+	/* on the master, that's the slave's - the host's */
+	if (ioctl(g_master_fd, TCGETS2, &tty) != 0) {
+		return 0;
+	}
+	return tty.c_ospeed;
+}
+
+static unsigned
+sketch_baudrate(void)
+{
+	/* always with U2X1 */
+	return F_CPU / 8 / (UBRR1 + 1);
+}
+
+static enum link_state
+link_state(unsigned host_rate)
+{
+	unsigned sketch_rate = sketch_baudrate();
+	unsigned diff = host_rate > sketch_rate ? host_rate - sketch_rate : sketch_rate - host_rate;
+
+	if (diff * 100 > host_rate * 3) {
+		return LINK_MISMATCH;
+	} else if (host_rate > g_args.max_baudrate) {
+		return LINK_NOISY;
+	}
+	return LINK_OK;
+}
+
+/* what a byte sent at the host's rate looks like on the other end;
+ * returns the UCSR1A error bits */
+static uint8_t
+link_garble(enum link_state state, uint8_t *byte)
+{
+	if (state == LINK_MISMATCH) {
+		g_stats.bad_bytes++;
+		*byte ^= 0xA5;
+		return _BV(FE1);
+	} else if (state == LINK_NOISY && ++g_noise_count % 64 == 0) {
+		g_stats.bad_bytes++;
+		*byte ^= 0x10;
+	}
+	return 0;
+}
+
+/* burn the given amount of emulated AVR time; interrupts still come */
+static void
+spend_us(unsigned us)
+{
+	uint64_t until = now_us() + us;
+
+	while (now_us() < until) {
+		serial_sync();
+	}
+}
+
+unsigned long
+millis(void)
+{
+	return (now_us() - g_start_us) / 1000;
+}
+
+unsigned long
+micros(void)
+{
+	return now_us() - g_start_us;
+}
+
+/* run the rx interrupt for everything that's been fully shifted in by now */
+static void
+serial_sync(void)
+{
+	uint64_t now = now_us();
+
+	pthread_mutex_lock(&g_wire_lock);
+	while (g_wire_tail != g_wire_head) {
+		unsigned idx = g_wire_tail % (sizeof(g_wire) / sizeof(g_wire[0]));
+		uint64_t wait_us;
+
+		if (g_wire[idx].done_us > now) {
+			break;
+		}
+
+		wait_us = now - g_wire[idx].done_us;
+		g_stats.isr_wait_sum_us += wait_us;
+		if (wait_us > g_stats.isr_wait_max_us) {
+			g_stats.isr_wait_max_us = wait_us;
+		}
+
+		g_udr = g_wire[idx].byte;
+		g_rx_status = g_wire[idx].status;
+		g_wire_tail++;
+		USART1_RX_vect();
+	}
+	pthread_mutex_unlock(&g_wire_lock);
+}
+
+EmuUDR::operator uint8_t() const
+{
+	return g_udr;
+}
+
+EmuUCSRA::operator uint8_t() const
+{
+	return _BV(UDRE1) | _BV(TXC1) | g_rx_status;
+}
+
+EmuUDR &
+EmuUDR::operator=(uint8_t b)
+{
+	/* the tx timing isn't modelled - it's just single byte acks and such */
+	link_garble(link_state(host_baudrate()), &b);
+	g_stats.tx_bytes++;
+	g_loop_consumed = true;
+	if (::write(g_master_fd, &b, 1) != 1) {
+		fprintf(stderr, "pty write failed: %s\n", strerror(errno));
+	}
+	return *this;
+}
+
+void
+emu_hid_report(const char *dev, const void *data, unsigned len)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	unsigned i;
+
+	g_stats.reports++;
+	spend_us(g_args.hid_cost_us);
+
+	if (!g_report_file) {
+		return;
+	}
+
+	fprintf(g_report_file, "%lu %s", micros(), dev);
+	for (i = 0; i < len; i++) {
+		fprintf(g_report_file, " %02x", bytes[i]);
+	}
+	fputc('\n', g_report_file);
+}
+
+static void *
+wire_thread_fn(void *arg)
+{
+	uint8_t buf[256];
+	int i, rc;
+
+	while (!g_stop) {
+		rc = read(g_master_fd, buf, sizeof(buf));
+		if (rc <= 0) {
+			/* EIO while the host doesn't have the pty open */
+			usleep(1000);
+			continue;
+		}
+
+		uint64_t now = now_us();
+		unsigned host_rate = host_baudrate();
+		uint64_t byte_ns = host_rate ? 10 * 1000000000ULL / host_rate : 0; /* 8n1 */
+		enum link_state state;
+
+		pthread_mutex_lock(&g_wire_lock);
+		state = link_state(host_rate);
+		g_stats.rx_bytes += rc;
+		for (i = 0; i < rc; i++) {
+			unsigned idx = g_wire_head % (sizeof(g_wire) / sizeof(g_wire[0]));
+
+			if (g_wire_last_done_ns < now * 1000) {
+				g_wire_last_done_ns = now * 1000;
+			}
+			g_wire_last_done_ns += byte_ns;
+			g_wire[idx].done_us = (g_wire_last_done_ns + 999) / 1000;
+			g_wire[idx].byte = buf[i];
+			g_wire[idx].status = link_garble(state, &g_wire[idx].byte);
+			g_wire_head++;
+		}
+		pthread_mutex_unlock(&g_wire_lock);
+	}
+
+	return NULL;
+}
+
+static void
+handle_stop_signal(int signo)
+{
+	g_stop = 1;
+}
+
+static void
+handle_degrade_signal(int signo)
+{
+	g_args.max_baudrate /= 2;
+}
+
+static void
+handle_reset_signal(int signo)
+{
+	g_reset = 1;
+	g_stop = 1;
+}
+
+static void
+reset(char *argv[])
+{
+	char fd_str[16];
+	char **new_argv;
+	int argc;
+
+	for (argc = 0; argv[argc]; argc++);
+	new_argv = (char **)calloc(argc + 3, sizeof(*new_argv));
+	memcpy(new_argv, argv, argc * sizeof(*new_argv));
+	snprintf(fd_str, sizeof(fd_str), "%d", g_master_fd);
+	new_argv[argc] = (char *)"-F";
+	new_argv[argc + 1] = fd_str;
+
+	fprintf(stderr, "resetting\n");
+	execv("/proc/self/exe", new_argv);
+	fprintf(stderr, "can't reset: %s\n", strerror(errno));
+}
+
+static void
+print_stats(void)
+{
+	fprintf(stderr, "rx bytes: %" PRIu64 ", tx bytes: %" PRIu64 "\n",
+			g_stats.rx_bytes, g_stats.tx_bytes);
+	fprintf(stderr, "loops consuming data: %" PRIu64 ", hid reports: %" PRIu64 "\n",
+			g_stats.loops_consumed, g_stats.reports);
+	fprintf(stderr, "rx interrupt latency avg %" PRIu64 " us, max %" PRIu64 " us\n",
+			g_wire_tail ? g_stats.isr_wait_sum_us / g_wire_tail : 0, g_stats.isr_wait_max_us);
+	fprintf(stderr, "last at %u baud, garbled bytes: %" PRIu64 "\n",
+			sketch_baudrate(), g_stats.bad_bytes);
+}
+
+static void
+print_help(const char *argv0)
+{
+	fprintf(stderr, "%s [-b max_clean_baudrate] [-c loop_cost_us] [-u hid_report_cost_us]\n"
+			"\t[-o /path/to/reports.log] [-l /path/to/pty/symlink]\n"
+			"kill -USR1 resets the emulated board, -USR2 halves max_clean_baudrate\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct termios tty;
+	pthread_t wire_thread;
+	int slave_fd, c;
+
+	while ((c = getopt(argc, argv, "hb:c:u:o:l:F:")) != -1) {
+		switch (c) {
+			case 'b':
+				g_args.max_baudrate = atoi(optarg);
+				break;
+			case 'c':
+				g_args.loop_cost_us = atoi(optarg);
+				break;
+			case 'u':
+				g_args.hid_cost_us = atoi(optarg);
+				break;
+			case 'o':
+				g_args.report_path = optarg;
+				break;
+			case 'l':
+				g_args.link_path = optarg;
+				break;
+			case 'F':
+				g_args.master_fd = atoi(optarg);
+				break;
+			default:
+				print_help(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (g_args.max_baudrate == 0) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	if (g_args.master_fd >= 0) {
+		g_master_fd = g_args.master_fd;
+	} else {
+		g_master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	}
+	if (g_master_fd < 0 || grantpt(g_master_fd) != 0 || unlockpt(g_master_fd) != 0) {
+		fprintf(stderr, "can't create a pty: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* keep the slave open, so reads on the master don't fail with EIO
+	 * between host sessions */
+	slave_fd = open(ptsname(g_master_fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (slave_fd < 0) {
+		fprintf(stderr, "can't open %s: %s\n", ptsname(g_master_fd), strerror(errno));
+		return 1;
+	}
+	tcgetattr(slave_fd, &tty);
+	cfmakeraw(&tty);
+	tcsetattr(slave_fd, TCSANOW, &tty);
+
+	if (g_args.link_path && g_args.master_fd < 0) {
+		unlink(g_args.link_path);
+		if (symlink(ptsname(g_master_fd), g_args.link_path) != 0) {
+			fprintf(stderr, "can't symlink %s: %s\n", g_args.link_path, strerror(errno));
+			return 1;
+		}
+	}
+
+	if (g_args.report_path) {
+		g_report_file = fopen(g_args.report_path, g_args.master_fd >= 0 ? "a" : "w");
+		if (!g_report_file) {
+			fprintf(stderr, "can't open %s: %s\n", g_args.report_path, strerror(errno));
+			return 1;
+		}
+	}
+
+	struct sigaction sa = {};
+	sa.sa_handler = handle_stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = handle_reset_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_handler = handle_degrade_signal;
+	sigaction(SIGUSR2, &sa, NULL);
+
+	if (g_args.master_fd < 0) {
+		printf("%s\n", ptsname(g_master_fd));
+		fflush(stdout);
+	}
+
+	g_start_us = now_us();
+	pthread_create(&wire_thread, NULL, wire_thread_fn, NULL);
+
+	setup();
+
+	while (!g_stop) {
+		g_loop_consumed = false;
+		serial_sync();
+		loop();
+
+		if (g_loop_consumed) {
+			g_stats.loops_consumed++;
+			spend_us(g_args.loop_cost_us);
+		} else {
+			/* nothing to do; don't spin the host CPU for it */
+			usleep(50);
+		}
+	}
+
+	print_stats();
+	if (g_report_file) {
+		fclose(g_report_file);
+	}
+	if (g_reset) {
+		reset(argv);
+		return 1;
+	}
+	if (g_args.link_path) {
+		unlink(g_args.link_path);
+	}
+
+	/* the wire thread might be blocked in read(), don't wait for it */
+	return 0;
+}
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+# Copyright(c) 2022 Darek Stojaczyk
+#
+# Generate a synthetic synergy server stream for --replay: the greeting,
+# the usual handshake, then mostly mouse movement with some scrolling,
+# clicking and typing mixed in, at about the pace of a real session (mouse
+# moves every 8 ms). Deterministic, so runs are comparable.
+#
+# With --rel, a game with the pointer locked instead: relative moves from
+# a 1000 Hz mouse, with some clicks and WASD mixed in.
+#
+#   ./gen-workload.py [--rel] [npackets] > workload.bin
+
+import math
+import random
+import struct
+import sys
+
+SCREEN_W, SCREEN_H = 1920 * 2, 1080
+
+class Stream:
+    """Each packet is a chunk of its own, as if received separately"""
+
+    def __init__(self):
+        self.ts_us = 0
+        self.chunks = []
+
+    def pkt(self, body, gap_us=0):
+        self.ts_us += gap_us
+        data = struct.pack('>I', len(body)) + body
+        self.chunks.append(struct.pack('>QI', self.ts_us, len(data)) + data)
+
+def desktop(pkt, rnd, npackets):
+    t = 0.0
+    for i in range(npackets):
+        r = rnd.random()
+        if i % 500 == 0:
+            pkt(b'CALV')
+        elif r < 0.80:
+            t += 0.01
+            x = int(SCREEN_W / 2 + math.cos(t) * SCREEN_W / 3)
+            y = int(SCREEN_H / 2 + math.sin(t * 1.3) * SCREEN_H / 3)
+            pkt(b'DMMV' + struct.pack('>HH', x, y), 8000)
+        elif r < 0.90:
+            pkt(b'DMRM' + struct.pack('>hh', rnd.randint(-5, 5), rnd.randint(-5, 5)), 8000)
+        elif r < 0.98:
+            pkt(b'DMWM' + struct.pack('>hh', 0, rnd.choice((-120, -60, 60, 120))), 16000)
+        elif r < 0.99:
+            btn = rnd.choice((1, 2, 3))
+            pkt(b'DMDN' + struct.pack('>B', btn), 100000)
+            pkt(b'DMUP' + struct.pack('>B', btn), 80000)
+        else:
+            ch = ord(rnd.choice('abcdefghijklmnopqrstuvwxyz'))
+            pkt(b'DKDN' + struct.pack('>HHH', ch, 0, 0), 150000)
+            pkt(b'DKUP' + struct.pack('>HHH', ch, 0, 0), 90000)
+
+def game(pkt, rnd, npackets):
+    t = 0.0
+    held = None
+    for i in range(npackets):
+        r = rnd.random()
+        if i % 500 == 0:
+            pkt(b'CALV')
+        elif r < 0.98:
+            # aiming: a smooth sweep, a few pixels per ms at most
+            t += 0.001
+            dx = round(math.sin(t * 3.1) * 4 + rnd.uniform(-1, 1))
+            dy = round(math.sin(t * 1.7) * 2 + rnd.uniform(-1, 1))
+            pkt(b'DMRM' + struct.pack('>hh', dx, dy), 1000)
+        elif r < 0.99:
+            pkt(b'DMDN' + struct.pack('>B', 1), 1000)
+            pkt(b'DMUP' + struct.pack('>B', 1), 1000)
+        elif held is None:
+            held = ord(rnd.choice('wasd'))
+            pkt(b'DKDN' + struct.pack('>HHH', held, 0, 0), 1000)
+        else:
+            pkt(b'DKUP' + struct.pack('>HHH', held, 0, 0), 1000)
+            held = None
+
+def main():
+    args = sys.argv[1:]
+    rel = '--rel' in args
+    args = [a for a in args if a != '--rel']
+    npackets = int(args[0]) if args else 200000
+    rnd = random.Random(1)
+    out = Stream()
+    pkt = out.pkt
+    pkt(b'Synergy' + struct.pack('>HH', 1, 6))
+    pkt(b'QINF', 1000)
+    pkt(b'CIAK', 1000)
+    pkt(b'CROP')
+    pkt(b'DSOP' + struct.pack('>I', 2) + b'HART' + struct.pack('>I', 3000))
+    pkt(b'CINN' + struct.pack('>HHIH', 100, 100, 1, 0), 1000)
+
+    (game if rel else desktop)(pkt, rnd, npackets)
+    pkt(b'COUT', 1000)
+    sys.stdout.buffer.write(b''.join(out.chunks))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,73 @@
+#!/bin/bash
+# SPDX-License-Identifier: MIT
+# Copyright(c) 2022 Darek Stojaczyk
+#
+# Set up a USB HID gadget via configfs that looks just like the Arduino
+# running arduino.ino: a single HID interface with HID-Project's keyboard
+# (report ID 2) and absolute mouse (report ID 7). Run as root. Without a
+# real device controller, `modprobe dummy_hcd` first.
+#
+#   ./hidg-gadget.sh [up|down]
+
+set -e
+
+G=/sys/kernel/config/usb_gadget/synergy_serial
+
+report_desc() {
+	# keyboard
+	printf '\x05\x01\x09\x06\xa1\x01\x85\x02'
+	printf '\x05\x07\x19\xe0\x29\xe7\x15\x00\x25\x01\x75\x01\x95\x08\x81\x02'
+	printf '\x05\x0c\x95\x01\x75\x08\x15\x00\x26\xff\x00\x19\x00\x29\xff\x81\x00'
+	# 8 LEDs like HID-Project's: num lock - kana, then 3 custom ones
+	printf '\x05\x08\x19\x01\x29\x08\x95\x08\x75\x01\x91\x02'
+	printf '\x05\x07\x95\x06\x75\x08\x15\x00\x26\xe7\x00\x19\x00\x29\xe7\x81\x00'
+	printf '\xc0'
+	# absolute mouse, 0 - 32767 on both axes
+	printf '\x05\x01\x09\x02\xa1\x01\x09\x01\xa1\x00\x85\x07'
+	printf '\x05\x09\x19\x01\x29\x05\x15\x00\x25\x01\x95\x05\x75\x01\x81\x02'
+	printf '\x95\x01\x75\x03\x81\x03'
+	printf '\x05\x01\x09\x30\x09\x31\x15\x00\x26\xff\x7f\x75\x10\x95\x02\x81\x02'
+	printf '\x09\x38\x15\x81\x25\x7f\x75\x08\x95\x01\x81\x06'
+	printf '\xc0\xc0'
+}
+
+up() {
+	modprobe libcomposite
+	mkdir -p $G
+	cd $G
+
+	# Arduino Leonardo
+	echo 0x2341 > idVendor
+	echo 0x8036 > idProduct
+	mkdir -p strings/0x409
+	echo "synergy-serial" > strings/0x409/manufacturer
+	echo "synergy-serial HID" > strings/0x409/product
+
+	mkdir -p functions/hid.usb0
+	echo 0 > functions/hid.usb0/protocol
+	echo 0 > functions/hid.usb0/subclass
+	# the longest report, including the report ID
+	echo 9 > functions/hid.usb0/report_length
+	report_desc > functions/hid.usb0/report_desc
+
+	mkdir -p configs/c.1
+	ln -sf $G/functions/hid.usb0 configs/c.1/
+
+	ls /sys/class/udc | head -n1 > UDC
+	ls /dev/hidg*
+}
+
+down() {
+	cd $G
+	echo "" > UDC || true
+	rm -f configs/c.1/hid.usb0
+	rmdir configs/c.1 functions/hid.usb0 strings/0x409
+	cd ..
+	rmdir $G
+}
+
+case "${1:-up}" in
+	up) up ;;
+	down) down ;;
+	*) echo "$0 [up|down]"; exit 1 ;;
+esac
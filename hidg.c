@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "hidg.h"
+#include "absmap.h"
+#include "config.h"
+#include "common.h"
+#include "trace.h"
+#include "stats.h"
+#include "clock.h"
+
+static int g_fd = -1;
+static struct hidg_keyboard_report g_kbd_report = { .id = HIDG_REPORTID_KEYBOARD };
+static struct hidg_mouse_report g_mouse_report = { .id = HIDG_REPORTID_MOUSE_ABSOLUTE };
+static uint16_t g_hid_x, g_hid_y;
+static bool g_mouse_dirty;
+/* raw wheel deltas (CONFIG_WHEEL_DELTA_PER_NOTCH per notch) not sent yet */
+static int32_t g_wheel_x, g_wheel_y;
+
+bool
+hidg_keyboard_report_key(struct hidg_keyboard_report *report, uint16_t id, bool down)
+{
+	uint8_t prev_modifiers = report->modifiers;
+	unsigned i;
+
+	if (id >= 0xE0 && id <= 0xE7) {
+		if (down) {
+			report->modifiers |= 1 << (id - 0xE0);
+		} else {
+			report->modifiers &= ~(1 << (id - 0xE0));
+		}
+		return report->modifiers != prev_modifiers;
+	}
+
+	if (id == 0 || id > 0xFF) {
+		return false;
+	}
+
+	for (i = 0; i < sizeof(report->keys); i++) {
+		if (report->keys[i] == id) {
+			if (down) {
+				return false;
+			}
+			report->keys[i] = 0;
+			return true;
+		}
+	}
+
+	if (!down) {
+		return false;
+	}
+
+	for (i = 0; i < sizeof(report->keys); i++) {
+		if (report->keys[i] == 0) {
+			report->keys[i] = id;
+			return true;
+		}
+	}
+
+	/* 6KRO, just like HID-Project's Keyboard */
+	LOG(LOG_DEBUG_1, "too many keys held, dropping 0x%x", id);
+	return false;
+}
+
+static int
+hidg_write(const void *buf, size_t len)
+{
+	ssize_t rc;
+
+	TRACE_BEGIN(hidg_write, len);
+	while (1) {
+		/* the gadget driver takes whole reports or nothing */
+		rc = write(g_fd, buf, len);
+		if (rc < 0 && errno == EAGAIN) {
+			/* the USB host didn't poll for the previous report yet */
+			struct pollfd pfd = { .fd = g_fd, .events = POLLOUT };
+
+			if (poll(&pfd, 1, CONFIG_HIDG_WRITE_TIMEOUT_MS) == 0) {
+				LOG(LOG_ERROR, "HID report not taken by the host in %d ms, dropping it",
+						CONFIG_HIDG_WRITE_TIMEOUT_MS);
+				rc = -ETIMEDOUT;
+				break;
+			}
+			continue;
+		} else if (rc < 0 && errno == EINTR) {
+			continue;
+		} else if (rc < 0) {
+			rc = -errno;
+			LOG(LOG_ERROR, "HID report write: %s", strerror(-rc));
+		}
+		break;
+	}
+	TRACE_END(hidg_write, rc);
+	if (rc < 0) {
+		return rc;
+	}
+
+	g_hidg_sink.nwrites++;
+	g_hidg_sink.nmsgs++;
+
+	if (g_stats_last_recv_us) {
+		STATS_HIST_ADD(&g_stats_recv_to_write_us, clock_now_us() - g_stats_last_recv_us);
+		g_stats_last_recv_us = 0;
+	}
+
+	return 0;
+}
+
+static int
+send_mouse_report(void)
+{
+	g_mouse_report.x = htole16(g_hid_x);
+	g_mouse_report.y = htole16(g_hid_y);
+	g_mouse_dirty = false;
+	return hidg_write(&g_mouse_report, sizeof(g_mouse_report));
+}
+
+static int
+send_keyboard_report(void)
+{
+	return hidg_write(&g_kbd_report, sizeof(g_kbd_report));
+}
+
+static int
+hidg_sink_set_pos(struct sink *sink, uint16_t x, uint16_t y)
+{
+	absmap_point(x, y, &g_hid_x, &g_hid_y);
+	g_mouse_dirty = true;
+	return 0;
+}
+
+static int
+hidg_sink_move(struct sink *sink, int16_t dx, int16_t dy)
+{
+	int16_t hid_dx, hid_dy;
+	int32_t x, y;
+
+	absmap_delta(dx, dy, &hid_dx, &hid_dy);
+	x = g_hid_x + hid_dx;
+	y = g_hid_y + hid_dy;
+	g_hid_x = x < 0 ? 0 : (x > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : x);
+	g_hid_y = y < 0 ? 0 : (y > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : y);
+	g_mouse_dirty = true;
+	return 0;
+}
+
+static int
+hidg_sink_button(struct sink *sink, uint8_t id, bool down)
+{
+	if (down) {
+		g_mouse_report.buttons |= id;
+	} else {
+		g_mouse_report.buttons &= ~id;
+	}
+
+	/* carries the pending position as well */
+	return send_mouse_report();
+}
+
+static int
+hidg_sink_wheel(struct sink *sink, int16_t dx, int16_t dy)
+{
+	g_wheel_x += dx;
+	g_wheel_y += dy;
+	return 0;
+}
+
+static int
+hidg_sink_key(struct sink *sink, uint16_t id, bool down)
+{
+	if (!hidg_keyboard_report_key(&g_kbd_report, id, down)) {
+		return 0;
+	}
+
+	return send_keyboard_report();
+}
+
+static int
+hidg_sink_release_all(struct sink *sink)
+{
+	/* everything was released one by one already */
+	return 0;
+}
+
+static int
+hidg_sink_flush(struct sink *sink)
+{
+	int8_t wheel_x, wheel_y;
+	int rc = 0;
+
+	wheel_x = sink_take_wheel_notches(&g_wheel_x);
+	wheel_y = sink_take_wheel_notches(&g_wheel_y);
+
+	if (g_mouse_dirty || wheel_y) {
+		g_mouse_report.wheel = wheel_y;
+		rc = send_mouse_report();
+		g_mouse_report.wheel = 0;
+	}
+
+	if (wheel_x) {
+		/* there's no horizontal wheel in the report, so do shift + wheel
+		 * just like the firmware */
+		bool shift_held = g_kbd_report.modifiers & (1 << (HID_USAGE_LEFT_SHIFT - 0xE0));
+
+		if (!shift_held && hidg_keyboard_report_key(&g_kbd_report, HID_USAGE_LEFT_SHIFT, true)) {
+			send_keyboard_report();
+		}
+		g_mouse_report.wheel = -wheel_x;
+		rc = send_mouse_report();
+		g_mouse_report.wheel = 0;
+		if (!shift_held && hidg_keyboard_report_key(&g_kbd_report, HID_USAGE_LEFT_SHIFT, false)) {
+			send_keyboard_report();
+		}
+	}
+
+	return rc;
+}
+
+static const struct sink_ops g_hidg_sink_ops = {
+	.move = hidg_sink_move,
+	.set_pos = hidg_sink_set_pos,
+	.button = hidg_sink_button,
+	.wheel = hidg_sink_wheel,
+	.key = hidg_sink_key,
+	/* the target repeats held keys on its own, as with any USB keyboard */
+	.key_repeat = NULL,
+	.release_all = hidg_sink_release_all,
+	.flush = hidg_sink_flush,
+};
+
+struct sink g_hidg_sink = {
+	.name = "hidg",
+	.ops = &g_hidg_sink_ops,
+};
+
+int
+hidg_init(const char *devpath)
+{
+	int flags = O_WRONLY | O_NONBLOCK;
+
+	absmap_init();
+
+	/* a missing /dev/hidgN means the gadget isn't set up, don't paper
+	 * over that with a regular file */
+	if (strncmp(devpath, "/dev/", strlen("/dev/")) != 0) {
+		flags |= O_CREAT | O_TRUNC;
+	}
+
+	g_fd = open(devpath, flags, 0644);
+	if (g_fd < 0) {
+		int rc = -errno;
+
+		LOG(LOG_ERROR, "Can't open HID gadget at \"%s\": %s%s", devpath, strerror(-rc),
+				rc == -ENOENT ? ". Was it set up with hidg-gadget.sh?" : "");
+		return rc;
+	}
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_HIDG
+#define SYNERGY_SERIAL_HIDG
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sink.h"
+
+/* Report IDs of the HID-Project keyboard and absolute mouse; both share
+ * a single HID interface, just like on the Arduino */
+#define HIDG_REPORTID_KEYBOARD 2
+#define HIDG_REPORTID_MOUSE_ABSOLUTE 7
+
+#define HID_USAGE_LEFT_SHIFT 0xE1
+
+struct hidg_keyboard_report {
+	uint8_t id;
+	uint8_t modifiers;
+	uint8_t reserved;
+	uint8_t keys[6];
+} __attribute__((packed));
+
+struct hidg_mouse_report {
+	uint8_t id;
+	uint8_t buttons;
+	uint16_t x; /**< little endian, 0 - ABSMAP_HID_MAX */
+	uint16_t y; /**< little endian, 0 - ABSMAP_HID_MAX */
+	int8_t wheel;
+} __attribute__((packed));
+
+/** Press or release a HID keyboard usage; returns true if the report changed */
+bool hidg_keyboard_report_key(struct hidg_keyboard_report *report, uint16_t id, bool down);
+
+/** Open the HID gadget device, or a plain file standing in for it (created
+ * if missing, unless it's under /dev) */
+int hidg_init(const char *devpath);
+
+/** The sink writing HID reports straight to a USB HID gadget */
+extern struct sink g_hidg_sink;
+
+#endif /* SYNERGY_SERIAL_HIDG */
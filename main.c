@@ -13,29 +13,213 @@
 #include <netinet/tcp.h>
 #include <getopt.h>
  #include <sys/timerfd.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
 
 #include "synergy_proto.h"
 #include "common.h"
 #include "serial.h"
+#include "simlink.h"
+#include "uinput.h"
+#include "hidg.h"
+#include "tls.h"
+#include "replay.h"
+#include "clock.h"
+#include "sink.h"
 #include "config.h"
+#include "trace.h"
+#include "tap.h"
+#include "stats.h"
+#include "realtime.h"
 
+struct sink *g_sink;
 static struct synergy_proto_conn g_conn = {};
+static int g_server_fd = -1;
 static struct {
+	const char *output;
 	const char *serial_devpath;
 	int baudrate;
-} g_args;
+	const char *trace_path;
+	int busy_poll_us;
+	int rt_prio;
+	const char *rt_cpus;
+	const char *tls_fingerprint;
+	const char *replay_path;
+	const char *record_path;
+	bool simulate;
+	int txq_budget_us;
+	bool no_rel_mouse;
+	const char *tap_name;
+} g_args = { .txq_budget_us = CONFIG_SERIAL_TXQ_BUDGET_US };
+
+static volatile sig_atomic_t g_stop;
+
+static char g_recv_buf[2048];
+static uint64_t g_next_tick_us;
 
 static struct option g_options[] = {
 	{ "help", no_argument, NULL, 'h' },
+	{ "output", required_argument, NULL, 'o' },
 	{ "baudrate", required_argument, NULL, 'b' },
 	{ "device", required_argument, NULL, 'd' },
+	{ "trace", required_argument, NULL, 't' },
+	{ "busy-poll", required_argument, NULL, 'p' },
+	{ "realtime", optional_argument, NULL, 'r' },
+	{ "cpus", required_argument, NULL, 'c' },
+	{ "stats", no_argument, NULL, 's' },
+	{ "tls-fingerprint", required_argument, NULL, 'f' },
+	{ "replay", required_argument, NULL, 'R' },
+	{ "record", required_argument, NULL, 'w' },
+	{ "simulate", no_argument, NULL, 'S' },
+	{ "txq-budget", required_argument, NULL, 'q' },
+	{ "no-rel-mouse", no_argument, NULL, 'M' },
+	{ "tap", required_argument, NULL, 'T' },
 	{ 0, 0, 0, 0 },
 };
 
 static void
 print_help(const char *argv0)
 {
-	fprintf(stderr, "%s -d /path/to/serialdev -b baudrate\n", argv0);
+	fprintf(stderr, "%s [-o serial|serial-raw] -d /path/to/serialdev [-b baudrate|auto] [-t /path/to/trace.json]\n"
+			"\t[-p busy_poll_idle_us] [--realtime[=prio]] [--cpus 1,2-3] [--stats]\n"
+			"\t[--tls-fingerprint sha256] [--record|--replay /path/to/stream.bin [--simulate]]\n"
+			"\t[--txq-budget us] [--no-rel-mouse] [--tap /shm-name]\n"
+			"%s -o uinput|hidg [-d /dev/hidgN] [...]\n", argv0, argv0);
+}
+
+static void
+set_sockopt_int(int fd, int level, int optname, const char *optstr, int val)
+{
+	if (setsockopt(fd, level, optname, &val, sizeof(val)) != 0) {
+		LOG(LOG_ERROR, "setsockopt(%s): %s", optstr, strerror(errno));
+	}
+}
+
+#define SET_SOCKOPT_INT(fd, level, optname, val) \
+	set_sockopt_int((fd), (level), (optname), #optname, (val))
+
+static void
+handle_stop_signal(int signo)
+{
+	g_stop = 1;
+}
+
+/* the responses go out through tls.c, which has our one TLS session */
+static ssize_t
+send_to_server(struct synergy_proto_conn *conn, const void *buf, size_t len)
+{
+	return tls_send(g_server_fd, buf, len, MSG_NOSIGNAL);
+}
+
+static int
+recv_pkts(int flags)
+{
+	int nbytes, rc;
+
+	nbytes = tls_recv(g_server_fd, g_recv_buf, sizeof(g_recv_buf), flags);
+	if (nbytes < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			LOG(LOG_ERROR, "recv returned %d, errno=%d", nbytes, errno);
+		}
+		return -errno;
+	}
+
+	if (nbytes == 0) {
+		if (g_args.replay_path) {
+			LOG(LOG_INFO, "end of the replay");
+		} else {
+			LOG(LOG_ERROR, "server closed the connection");
+		}
+		return -ENOTCONN;
+	}
+
+	g_stats_last_recv_us = clock_now_us();
+	record_write(g_recv_buf, nbytes);
+
+	if (!g_args.replay_path) {
+		/* quickack mode isn't permanent, the kernel may leave it anytime */
+		SET_SOCKOPT_INT(g_server_fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+	}
+
+	TRACE_BEGIN(recv, nbytes);
+	rc = synergy_proto_push(&g_conn, g_recv_buf, nbytes);
+	TRACE_END(recv, 0);
+	return rc < 0 ? rc : nbytes;
+}
+
+static void
+handle_timer_tick(int timerfd)
+{
+	uint64_t now_us = clock_now_us();
+	uint64_t expirations;
+
+	if (timerfd < 0) {
+		/* simulated, just like the timerfd would count it */
+		expirations = (now_us - g_next_tick_us) / (CONFIG_SERIAL_MOUSE_INTERVAL_MS * 1000) + 1;
+	} else if (read(timerfd, &expirations, sizeof(expirations)) < 0) {
+		/* non-blocking; clears the readiness */
+		return;
+	}
+
+	STATS_HIST_ADD(&g_stats_tick_lateness_us, now_us - g_next_tick_us);
+	g_next_tick_us += expirations * CONFIG_SERIAL_MOUSE_INTERVAL_MS * 1000;
+
+	TRACE_INSTANT(timer_tick, expirations);
+	sink_flush(g_sink);
+}
+
+/* Deliver each recorded chunk at its time on the simulated clock, with the
+ * timer ticks and the serial reads in between. Nothing here waits for real. */
+static int
+run_simulated(uint64_t start_us)
+{
+	uint64_t ts_us, wall_start_us = get_monotonic_us();
+	uint64_t elapsed_us;
+	int rc;
+
+	g_next_tick_us = start_us + CONFIG_SERIAL_MOUSE_INTERVAL_MS * 1000;
+
+	while (!g_stop) {
+		rc = replay_sim_next(&ts_us);
+		if (rc <= 0) {
+			break;
+		}
+
+		/* and whatever the firmware sends, as soon as it arrives */
+		while (1) {
+			uint64_t serial_us = simlink_next_us();
+
+			if (serial_us <= g_next_tick_us && serial_us <= start_us + ts_us) {
+				clock_sim_advance_to(serial_us);
+				serial_poll();
+			} else if (g_next_tick_us <= start_us + ts_us) {
+				clock_sim_advance_to(g_next_tick_us);
+				handle_timer_tick(-1);
+			} else {
+				break;
+			}
+		}
+
+		clock_sim_advance_to(start_us + ts_us);
+		replay_sim_deliver();
+		do {
+			rc = recv_pkts(MSG_DONTWAIT);
+		} while (rc > 0);
+
+		if (rc != -EAGAIN) {
+			break;
+		}
+	}
+
+	elapsed_us = get_monotonic_us() - wall_start_us;
+	LOG(LOG_INFO, "simulated %"PRIu64" us of traffic (%"PRIu64" packets) in %"PRIu64" us",
+			clock_now_us() - start_us, g_conn.npkts, elapsed_us);
+
+	if (rc == 0) {
+		LOG(LOG_INFO, "end of the replay");
+	}
+	return rc < 0 && rc != -ENOTCONN ? 1 : 0;
 }
 
 int
@@ -43,22 +227,16 @@ main(int argc, char *argv[])
 {
 	int fd;
 	struct sockaddr_in saddr_in = {};
-	struct pkt_buf {
-		char prev[2048];
-		char cur[2048];
-	} pkt_buf;
-	int prevlen = 0;
-	char *bufptr;
 	int rc;
-	unsigned buflen;
-	int serialfd;
-	int skip_nbytes = 0;
+	int serialfd = -1;
+	uint64_t sim_start_us;
+	int exit_code = 0;
 
 	while (1) {
 		int opt_index = 0;
 		char c;
 
-		c = getopt_long(argc, argv, "hb:d:", g_options, &opt_index);
+		c = getopt_long(argc, argv, "ho:b:d:t:p:r::c:sf:R:w:", g_options, &opt_index);
 		if (c == -1) {
 			break;
 		}
@@ -78,11 +256,55 @@ main(int argc, char *argv[])
 			case 'h':
 				print_help(argv[0]);
 				return 0;
+			case 'o':
+				g_args.output = optarg;
+				break;
 			case 'd':
 				g_args.serial_devpath = optarg;
 				break;
 			case 'b':
-				g_args.baudrate = atoi(optarg);
+				/* 0 is the fastest that works */
+				if (strcmp(optarg, "auto") == 0) {
+					g_args.baudrate = 0;
+				} else if ((g_args.baudrate = atoi(optarg)) == 0) {
+					g_args.baudrate = -1;
+				}
+				break;
+			case 't':
+				g_args.trace_path = optarg;
+				break;
+			case 'p':
+				g_args.busy_poll_us = atoi(optarg);
+				break;
+			case 'r':
+				g_args.rt_prio = optarg ? atoi(optarg) : CONFIG_RT_DEFAULT_PRIO;
+				break;
+			case 'c':
+				g_args.rt_cpus = optarg;
+				break;
+			case 's':
+				g_stats_enabled = true;
+				break;
+			case 'f':
+				g_args.tls_fingerprint = optarg;
+				break;
+			case 'R':
+				g_args.replay_path = optarg;
+				break;
+			case 'w':
+				g_args.record_path = optarg;
+				break;
+			case 'S':
+				g_args.simulate = true;
+				break;
+			case 'q':
+				g_args.txq_budget_us = atoi(optarg);
+				break;
+			case 'M':
+				g_args.no_rel_mouse = true;
+				break;
+			case 'T':
+				g_args.tap_name = optarg;
 				break;
 			case '?':
 				break;
@@ -91,69 +313,158 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (!g_args.serial_devpath || !g_args.baudrate) {
-		print_help(argv[0]);
+	if (!g_args.output || strcmp(g_args.output, "serial") == 0) {
+		g_sink = &g_serial_sink;
+	} else if (strcmp(g_args.output, "serial-raw") == 0) {
+		g_sink = &g_serial_raw_sink;
+	} else if (strcmp(g_args.output, "uinput") == 0) {
+		g_sink = &g_uinput_sink;
+	} else if (strcmp(g_args.output, "hidg") == 0) {
+		g_sink = &g_hidg_sink;
+	} else {
+		LOG(LOG_ERROR, "Unknown output: %s", g_args.output);
 		return 1;
 	}
 
-#define BAUDRATE(rate) case rate: g_args.baudrate = B ## rate; break
-
-	switch (g_args.baudrate) {
-		BAUDRATE(57600);
-		BAUDRATE(115200);
-		BAUDRATE(230400);
-		BAUDRATE(460800);
-		BAUDRATE(500000);
-		BAUDRATE(576000);
-		BAUDRATE(921600);
-		BAUDRATE(1000000);
-		BAUDRATE(1152000);
-		BAUDRATE(2000000);
-		BAUDRATE(2500000);
-		BAUDRATE(3000000);
-		BAUDRATE(3500000);
-		BAUDRATE(4000000);
-		default:
-			g_args.baudrate = 0;
-			break;
+	if (g_args.simulate) {
+		if (!g_args.replay_path) {
+			LOG(LOG_ERROR, "--simulate needs a --replay");
+			return 1;
+		}
+		clock_sim_init();
 	}
 
-#undef BAUDRATE
+	if (g_sink == &g_serial_sink || g_sink == &g_serial_raw_sink) {
+		if (!g_args.serial_devpath && !g_args.simulate) {
+			print_help(argv[0]);
+			return 1;
+		}
 
-	if (!g_args.baudrate) {
-		LOG(LOG_ERROR, "Invalid baudrate. Only a few are supported. See the code for details.");
-		return 1;
+		if (g_args.baudrate < 0) {
+			LOG(LOG_ERROR, "Invalid baudrate: %d", g_args.baudrate);
+			return 1;
+		}
 	}
 
-	serialfd = open(g_args.serial_devpath, O_RDWR | O_NOCTTY | O_SYNC);
-    if (serialfd < 0) {
-        LOG(LOG_ERROR, "Can't open serial device at \"%s\": %s\n",
-				g_args.serial_devpath, strerror(errno));
-        return 1;
-    }
+	if (g_args.trace_path) {
+		rc = trace_init(g_args.trace_path);
+		if (rc < 0) {
+			return 1;
+		}
+		atexit(trace_fini);
+	}
+
+	if (g_args.tap_name) {
+		rc = tap_init(g_args.tap_name);
+		if (rc < 0) {
+			return 1;
+		}
+		atexit(tap_fini);
+	}
 
-	serial_set_fd(serialfd, g_args.baudrate, 0, 1); /* given baudrate with 8n1 (no parity) */
+	/* no SA_RESTART, so that poll() wakes up and we can exit cleanly */
+	struct sigaction sa = { .sa_handler = handle_stop_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-	if (fd == -1) {
-		LOG(LOG_ERROR, "Could not create socket");
-		return 1;
+	if (g_sink == &g_uinput_sink) {
+		rc = uinput_init();
+		if (rc < 0) {
+			return 1;
+		}
+	} else if (g_sink == &g_hidg_sink) {
+		rc = hidg_init(g_args.serial_devpath ? g_args.serial_devpath : CONFIG_HIDG_DEVPATH);
+		if (rc < 0) {
+			return 1;
+		}
+	} else if (g_args.simulate) {
+		serial_set_txq_budget(g_args.txq_budget_us);
+		serial_set_rel_mouse(!g_args.no_rel_mouse);
+		rc = serial_set_simulated(g_args.baudrate);
+		if (rc < 0) {
+			return 1;
+		}
+	} else {
+		serialfd = open(g_args.serial_devpath, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (serialfd < 0) {
+			LOG(LOG_ERROR, "Can't open serial device at \"%s\": %s\n",
+					g_args.serial_devpath, strerror(errno));
+			return 1;
+		}
+
+		serial_set_txq_budget(g_args.txq_budget_us);
+		serial_set_rel_mouse(!g_args.no_rel_mouse);
+		rc = serial_set_fd(serialfd, g_args.baudrate, 0); /* given baudrate with 8n1 (no parity) */
+		if (rc < 0) {
+			LOG(LOG_ERROR, "Can't setup serial device at \"%s\"", g_args.serial_devpath);
+			return 1;
+		}
 	}
 
-	saddr_in.sin_family = AF_INET;
-	saddr_in.sin_port = htons(24800);
-	inet_pton(AF_INET, "127.0.0.1", &saddr_in.sin_addr);
+	if (g_sink == &g_serial_sink || g_sink == &g_serial_raw_sink) {
+		unsigned baudrate, nbytes, nerrors;
 
-	rc = connect(fd, (struct sockaddr *)&saddr_in, sizeof(saddr_in));
-	if (rc < 0) {
-		LOG(LOG_ERROR, "connect: %s", strerror(errno));
-		return 1;
+		serial_get_link_quality(&baudrate, &nbytes, &nerrors);
+		LOG(LOG_INFO, "serial link at %u baud, error rate %.3f%% (%u of %u test bytes)",
+				baudrate, nbytes ? nerrors * 100.0 / nbytes : 0.0, nerrors, nbytes);
+	}
+
+	if (g_args.record_path) {
+		rc = record_init(g_args.record_path);
+		if (rc < 0) {
+			return 1;
+		}
 	}
 
-	g_conn.fd = fd;
+	if (g_args.simulate) {
+		fd = replay_sim_open(g_args.replay_path);
+		if (fd < 0) {
+			return 1;
+		}
+	} else if (g_args.replay_path) {
+		fd = replay_open(g_args.replay_path);
+		if (fd < 0) {
+			return 1;
+		}
+	} else {
+		fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+		if (fd == -1) {
+			LOG(LOG_ERROR, "Could not create socket");
+			return 1;
+		}
+
+		saddr_in.sin_family = AF_INET;
+		saddr_in.sin_port = htons(24800);
+		inet_pton(AF_INET, "127.0.0.1", &saddr_in.sin_addr);
+
+		rc = connect(fd, (struct sockaddr *)&saddr_in, sizeof(saddr_in));
+		if (rc < 0) {
+			LOG(LOG_ERROR, "connect: %s", strerror(errno));
+			return 1;
+		}
+
+		/* the traffic is tiny and interactive - never let the kernel hold it */
+		SET_SOCKOPT_INT(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+		SET_SOCKOPT_INT(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+	}
+
+	if (g_args.tls_fingerprint) {
+		/* OpenSSL writes to the socket without MSG_NOSIGNAL */
+		signal(SIGPIPE, SIG_IGN);
+		rc = tls_connect(fd, g_args.tls_fingerprint);
+		if (rc < 0) {
+			return 1;
+		}
+		atexit(tls_fini);
+	}
+
+	g_server_fd = fd;
+	g_conn.send = send_to_server;
+	g_conn.sink = g_sink;
 	LOG(LOG_INFO, "connected");
+	sim_start_us = clock_now_us();
 
-	rc = recv(g_conn.fd, pkt_buf.cur, sizeof(pkt_buf.cur), 0);
+	rc = tls_recv(g_server_fd, g_recv_buf, sizeof(g_recv_buf), 0);
 	if (rc < 0) {
 		LOG(LOG_ERROR, "recv: %d", rc);
 		return 1;
@@ -163,130 +474,164 @@ main(int argc, char *argv[])
 		LOG(LOG_ERROR, "recv invalid packet, len=%d", rc);
 		return 1;
 	}
+	record_write(g_recv_buf, rc);
 
-	uint32_t len = ntohl(*(uint32_t *)pkt_buf.cur);
+	uint32_t len = ntohl(*(uint32_t *)g_recv_buf);
 	if (len + 4 != rc) {
 		LOG(LOG_ERROR, "recv malformed/incomplete greeting packet");
 		return 1;
 	}
 
-	g_conn.recv_buf = pkt_buf.cur + 4;
-	g_conn.recv_len = len;
-	rc = synergy_proto_handle_greeting(&g_conn);
+	rc = synergy_proto_push(&g_conn, g_recv_buf, rc);
 	if (rc < 0) {
-		LOG(LOG_ERROR, "synergy_proto_handle_greeting() returned %d", rc);
 		return 1;
 	}
 
-	int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (g_stats_enabled) {
+		atexit(stats_dump);
+	}
+
+	if (g_args.simulate) {
+		exit_code = run_simulated(sim_start_us);
+		sink_release_all(g_sink);
+		LOG(LOG_INFO, "exiting");
+		return exit_code;
+	}
+
+	int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
 	if (timerfd < 0) {
 		LOG(LOG_ERROR, "timerfd_create() returned %d", errno);
 		return 1;
 	}
 
 	struct itimerspec timerfd_time = { 0 };
-	timerfd_time.it_interval.tv_nsec = 1000 * CONFIG_SERIAL_MOUSE_INTERVAL_MS;
-	timerfd_time.it_value.tv_nsec = 1000 * CONFIG_SERIAL_MOUSE_INTERVAL_MS;
+	timerfd_time.it_interval.tv_nsec = 1000 * 1000 * CONFIG_SERIAL_MOUSE_INTERVAL_MS;
+	timerfd_time.it_value.tv_nsec = 1000 * 1000 * CONFIG_SERIAL_MOUSE_INTERVAL_MS;
 	timerfd_settime(timerfd, 0, &timerfd_time, NULL);
+	g_next_tick_us = clock_now_us() + CONFIG_SERIAL_MOUSE_INTERVAL_MS * 1000;
 
-	struct pollfd pfds[2];
-	pfds[0].fd = g_conn.fd;
+	struct pollfd pfds[3];
+	pfds[0].fd = g_server_fd;
 	pfds[0].events = POLLIN | POLLERR;
 
 	pfds[1].fd = timerfd;
 	pfds[1].events = POLLIN;
 
-	while (1) {
-		rc = poll(pfds, sizeof(pfds) / sizeof(pfds[0]), -1);
+	/* whatever the firmware sends between our writes; ignored if -1 */
+	pfds[2].fd = serialfd;
+	pfds[2].events = POLLIN;
+
+	uint64_t last_rx_us = 0;
+	uint64_t start_us = clock_now_us();
+	uint64_t nspins = 0, nspins_empty = 0, nfallbacks = 0, nnaps = 0;
+	uint64_t last_nap_us = start_us;
+	bool spinning = false;
+
+	if (g_args.rt_prio || g_args.rt_cpus) {
+		rc = realtime_setup(g_args.rt_prio, g_args.rt_cpus);
 		if (rc < 0) {
-			LOG(LOG_ERROR, "poll returned %d, errno=%d", rc, errno);
 			return 1;
 		}
+	}
 
-		if (pfds[0].revents & POLLIN) {
-			pfds[0].revents &= ~POLLIN;
+	if (g_args.busy_poll_us) {
+		/* let the kernel busy poll the device queue on our behalf too,
+		 * and don't bother waking us up for less than a packet header */
+		SET_SOCKOPT_INT(fd, SOL_SOCKET, SO_BUSY_POLL, CONFIG_BUSY_POLL_SOCK_US);
+		SET_SOCKOPT_INT(fd, SOL_SOCKET, SO_RCVLOWAT, 8);
+		LOG(LOG_INFO, "busy polling, falling back to poll() after %d us idle",
+				g_args.busy_poll_us);
+	}
 
-			rc = recv(fd, pkt_buf.cur, sizeof(pkt_buf.cur), 0);
-			if (rc < 0) {
-				LOG(LOG_ERROR, "recv returned %d, errno=%d", rc, errno);
-				return 1;
+	while (!g_stop) {
+		uint64_t now_us;
+
+		if (spinning) {
+			nspins++;
+			rc = recv_pkts(MSG_DONTWAIT);
+			now_us = clock_now_us();
+			if (rc > 0) {
+				last_rx_us = now_us;
+			} else if (rc == -EAGAIN || rc == -EINTR) {
+				nspins_empty++;
+			} else {
+				exit_code = (rc == -ENOTCONN && g_args.replay_path) ? 0 : 1;
+				break;
 			}
 
-			bufptr = pkt_buf.cur;
-			buflen = rc;
-
-			if (skip_nbytes > 0) {
-				prevlen = 0;
-
-				if (skip_nbytes >= buflen) {
-					skip_nbytes -= buflen;
-					continue;
-				} else {
-					bufptr += skip_nbytes;
-					buflen -= skip_nbytes;
-					skip_nbytes = 0;
-				}
+			if (now_us >= g_next_tick_us) {
+				handle_timer_tick(timerfd);
 			}
 
-			if (prevlen > 0) {
-				bufptr = pkt_buf.prev + sizeof(pkt_buf.prev) - prevlen;
-				buflen += prevlen;
-				prevlen = 0;
+			if (serialfd >= 0) {
+				serial_poll();
 			}
 
-			while (buflen >= 0) {
-				if (buflen < 4) {
-					memcpy(pkt_buf.prev + sizeof(pkt_buf.prev) - buflen, bufptr, buflen);
-					prevlen = buflen;
-					break;
-				}
-
-				uint32_t len = ntohl(*(uint32_t *)bufptr);
-				if (len + 4 >= 65536) {
-					/* we certainly screwed up somewhere */
-					LOG(LOG_ERROR, "recv incomplete packet: pktlen=%d, buflen=%d", len, rc);
-					return 1;
-				}
-
-				if (len + 4 >= 2048) {
-					/* we don't support packets this big (like clipboard contents) */
-					skip_nbytes = len + 4 - buflen;
-					LOG(LOG_ERROR, "recv too big packet: pktlen=%d, buflen=%d", len, rc);
-					break;
-				}
-
-				if (len + 4 > buflen) {
-					if (bufptr < pkt_buf.cur) {
-						LOG(LOG_ERROR, "recv too fragmented packet. expected len=%d, two packets len=%d", len, buflen);
-						return 1;
-					}
+			if (now_us - last_rx_us >= g_args.busy_poll_us) {
+				/* idle for too long, go back to sleeping in poll() */
+				spinning = false;
+				nfallbacks++;
+			} else if (g_args.rt_prio > 0 &&
+					now_us - last_nap_us >= CONFIG_RT_WATCHDOG_MS * 1000 / 2) {
+				/* a long drag never gets us to poll(), and the RLIMIT_RTTIME
+				 * watchdog only counts CPU time since we last slept */
+				usleep(CONFIG_BUSY_POLL_NAP_US);
+				last_nap_us = clock_now_us();
+				nnaps++;
+			}
+			continue;
+		}
 
-					memcpy(pkt_buf.prev + sizeof(pkt_buf.prev) - buflen, bufptr, buflen);
-					prevlen = buflen;
-					break;
-				}
+		rc = poll(pfds, sizeof(pfds) / sizeof(pfds[0]), -1);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG(LOG_ERROR, "poll returned %d, errno=%d", rc, errno);
+			exit_code = 1;
+			break;
+		}
 
-				g_conn.recv_buf = bufptr + 4;
-				g_conn.recv_len = len;
-				rc = synergy_handle_pkt(&g_conn);
-				if (rc < 0) {
-					LOG(LOG_ERROR, "synergy_handle_pkt() returned %d", rc);
-					return 1;
-				}
+		if (pfds[0].revents & (POLLIN | POLLERR)) {
+			/* drain whatever TLS already decrypted, poll() won't say */
+			do {
+				rc = recv_pkts(0);
+			} while (rc > 0 && tls_pending());
+			if (rc < 0 && rc != -EINTR) {
+				exit_code = (rc == -ENOTCONN && g_args.replay_path) ? 0 : 1;
+				break;
+			}
 
-				bufptr += len + 4;
-				buflen -= len + 4;
+			if (g_args.busy_poll_us) {
+				last_rx_us = clock_now_us();
+				spinning = true;
 			}
 		}
 
 		if (pfds[1].revents & POLLIN) {
-			pfds[0].revents &= ~POLLIN;
-
-			serial_ard_kick_mouse_move();
+			handle_timer_tick(timerfd);
+		}
 
-			usleep(16 * 1000);
+		if (pfds[2].revents & POLLIN) {
+			serial_poll();
 		}
 	}
 
-	return 0;
-}
+	if (g_args.busy_poll_us) {
+		LOG(LOG_INFO, "busy poll: %"PRIu64" spins (%"PRIu64" empty), %"PRIu64" fallbacks to poll(), "
+				"%"PRIu64" naps", nspins, nspins_empty, nfallbacks, nnaps);
+	}
+
+	if (g_args.replay_path) {
+		uint64_t elapsed_us = clock_now_us() - start_us;
+
+		LOG(LOG_INFO, "replayed %"PRIu64" packets in %"PRIu64" us (%"PRIu64" ns per packet)",
+				g_conn.npkts, elapsed_us, g_conn.npkts ? elapsed_us * 1000 / g_conn.npkts : 0);
+	}
+
+	/* don't leave anything stuck on the target */
+	sink_release_all(g_sink);
+
+	LOG(LOG_INFO, "exiting");
+	return exit_code;
+}
\ No newline at end of file
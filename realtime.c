@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "realtime.h"
+#include "common.h"
+#include "config.h"
+
+static void
+handle_rttime_signal(int signo)
+{
+	static const char msg[] = "realtime watchdog fired, dropping to SCHED_OTHER\n";
+	struct sched_param param = { 0 };
+
+	sched_setscheduler(0, SCHED_OTHER, &param);
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+}
+
+static void __attribute__((noinline))
+prefault_stack(void)
+{
+	volatile char buf[CONFIG_RT_PREFAULT_STACK_SIZE];
+	unsigned i;
+
+	for (i = 0; i < sizeof(buf); i += 4096) {
+		buf[i] = 0;
+	}
+}
+
+static int
+parse_cpulist(const char *cpulist, cpu_set_t *set)
+{
+	const char *str = cpulist;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*str) {
+		long first, last;
+
+		first = last = strtol(str, &end, 10);
+		if (end == str || first < 0) {
+			return -EINVAL;
+		}
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first) {
+				return -EINVAL;
+			}
+		}
+
+		if (last >= CPU_SETSIZE) {
+			return -EINVAL;
+		}
+
+		for (; first <= last; first++) {
+			CPU_SET(first, set);
+		}
+
+		str = end;
+		if (*str == ',') {
+			str++;
+		} else if (*str) {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+int
+realtime_setup(int prio, const char *cpulist)
+{
+	int rc;
+
+	/* MCL_CURRENT faults in all our static buffers (packet reassembly,
+	 * responses, serial state) right away; the stack still grows on
+	 * demand, so touch it now */
+	rc = mlockall(MCL_CURRENT | MCL_FUTURE);
+	if (rc != 0) {
+		LOG(LOG_ERROR, "mlockall() failed: %s. Need CAP_IPC_LOCK or a higher "
+				"RLIMIT_MEMLOCK, page faults can still cause jitter",
+				strerror(errno));
+	}
+	prefault_stack();
+
+	if (cpulist) {
+		cpu_set_t set;
+
+		rc = parse_cpulist(cpulist, &set);
+		if (rc != 0) {
+			LOG(LOG_ERROR, "invalid cpu list \"%s\"", cpulist);
+			return rc;
+		}
+
+		rc = sched_setaffinity(0, sizeof(set), &set);
+		if (rc != 0) {
+			LOG(LOG_ERROR, "sched_setaffinity(%s) failed: %s", cpulist, strerror(errno));
+		} else {
+			LOG(LOG_INFO, "pinned to cpus %s", cpulist);
+		}
+	}
+
+	if (prio <= 0) {
+		return 0;
+	}
+
+	/* the soft limit sends SIGXCPU, which demotes us. The hard one kills
+	 * us if even that didn't help */
+	struct rlimit rlim = {
+		.rlim_cur = CONFIG_RT_WATCHDOG_MS * 1000,
+		.rlim_max = CONFIG_RT_WATCHDOG_MS * 1000 * 2,
+	};
+	struct sigaction sa = { .sa_handler = handle_rttime_signal };
+
+	sigaction(SIGXCPU, &sa, NULL);
+	rc = setrlimit(RLIMIT_RTTIME, &rlim);
+	if (rc != 0) {
+		LOG(LOG_ERROR, "setrlimit(RLIMIT_RTTIME) failed: %s. Not going realtime "
+				"without a watchdog", strerror(errno));
+		return 0;
+	}
+
+	struct sched_param param = { .sched_priority = prio };
+	rc = sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param);
+	if (rc != 0) {
+		LOG(LOG_ERROR, "sched_setscheduler(SCHED_FIFO, %d) failed: %s. Need "
+				"CAP_SYS_NICE or a high enough RLIMIT_RTPRIO, running with "
+				"the default scheduler", prio, strerror(errno));
+		return 0;
+	}
+
+	LOG(LOG_INFO, "running with SCHED_FIFO priority %d, watchdog %d ms",
+			prio, CONFIG_RT_WATCHDOG_MS);
+	return 0;
+}
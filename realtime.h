@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_REALTIME
+#define SYNERGY_SERIAL_REALTIME
+
+/**
+ * Lock and pre-fault our memory, pin the process to the given CPUs (if any)
+ * and switch it to SCHED_FIFO with the given priority. An RLIMIT_RTTIME
+ * watchdog demotes us back to SCHED_OTHER if we ever hog the CPU without
+ * blocking. Every step is best-effort - missing privileges are logged,
+ * but not fatal.
+ *
+ * \param prio SCHED_FIFO priority, 0 to only lock memory and pin CPUs
+ * \param cpulist comma separated list of CPUs or CPU ranges, e.g. "2,4-5",
+ * or NULL
+ */
+int realtime_setup(int prio, const char *cpulist);
+
+#endif /* SYNERGY_SERIAL_REALTIME */
@@ -0,0 +1,291 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <endian.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+
+#include "replay.h"
+#include "common.h"
+#include "clock.h"
+
+static int g_record_fd = -1;
+static uint64_t g_record_start_us;
+
+/* precedes each chunk in the recording, big endian */
+struct replay_chunk_hdr {
+	uint64_t ts_us; /**< since the first chunk (the greeting) */
+	uint32_t len;
+} __attribute__((packed));
+
+#define REPLAY_CHUNK_MAX 32768
+
+int
+record_init(const char *path)
+{
+	g_record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (g_record_fd < 0) {
+		LOG(LOG_ERROR, "Can't open \"%s\": %s", path, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+void
+record_write(const void *buf, size_t len)
+{
+	struct replay_chunk_hdr hdr;
+	struct iovec iov[2];
+	uint64_t now_us = clock_now_us();
+
+	if (g_record_fd < 0) {
+		return;
+	}
+
+	if (g_record_start_us == 0) {
+		g_record_start_us = now_us;
+	}
+
+	hdr.ts_us = htobe64(now_us - g_record_start_us);
+	hdr.len = htobe32(len);
+	iov[0] = (struct iovec){ &hdr, sizeof(hdr) };
+	iov[1] = (struct iovec){ (void *)buf, len };
+
+	if (writev(g_record_fd, iov, 2) != sizeof(hdr) + len) {
+		LOG(LOG_ERROR, "recording write failed, stopping: %s", strerror(errno));
+		close(g_record_fd);
+		g_record_fd = -1;
+	}
+}
+
+/* returns the chunk length, 0 at the end of the file, -1 if it's corrupt */
+static int
+read_chunk(FILE *file, char *buf, uint64_t *ts_us)
+{
+	struct replay_chunk_hdr hdr;
+	uint32_t len;
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1) {
+		return 0;
+	}
+
+	len = be32toh(hdr.len);
+	if (len == 0 || len > REPLAY_CHUNK_MAX || fread(buf, len, 1, file) != 1) {
+		LOG(LOG_ERROR, "the recording is corrupted");
+		return -1;
+	}
+
+	*ts_us = be64toh(hdr.ts_us);
+	return len;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = write(fd, buf, len);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		buf += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+/* The child pretending to be the server. The greeting is sent on its own
+ * and answered first, as main() expects it in a single recv(). Then the
+ * rest is pushed as fast as the other side takes it, regardless of the
+ * timestamps, while its responses are drained. */
+static void
+replay_server(int sock, FILE *file)
+{
+	char buf[2 * REPLAY_CHUNK_MAX], drain[4096];
+	uint64_t ts_us;
+	ssize_t nbytes, off = 0, end = 0;
+	bool eof = false, shut = false;
+	int len;
+
+	len = read_chunk(file, buf, &ts_us);
+	if (len < 4 || ntohl(*(uint32_t *)buf) + 4 != len) {
+		LOG(LOG_ERROR, "the recording doesn't start with a greeting");
+		_exit(1);
+	}
+
+	if (write_all(sock, buf, len) != 0 || read(sock, drain, sizeof(drain)) <= 0) {
+		_exit(1);
+	}
+
+	while (1) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+		if (off == end && !eof) {
+			/* batch up the chunks, so it's not a syscall per packet */
+			off = end = 0;
+			while (end < REPLAY_CHUNK_MAX) {
+				len = read_chunk(file, buf + end, &ts_us);
+				if (len <= 0) {
+					eof = true;
+					break;
+				}
+				end += len;
+			}
+		}
+
+		if (off == end && eof && !shut) {
+			shutdown(sock, SHUT_WR);
+			shut = true;
+		}
+
+		if (off < end) {
+			pfd.events |= POLLOUT;
+		}
+
+		if (poll(&pfd, 1, -1) < 0) {
+			continue;
+		}
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			nbytes = read(sock, drain, sizeof(drain));
+			if (nbytes <= 0) {
+				/* the client is gone */
+				_exit(0);
+			}
+		}
+
+		if (pfd.revents & POLLOUT) {
+			nbytes = write(sock, buf + off, end - off);
+			if (nbytes > 0) {
+				off += nbytes;
+			}
+		}
+	}
+}
+
+int
+replay_open(const char *path)
+{
+	int sv[2];
+	FILE *file;
+	pid_t pid;
+
+	file = fopen(path, "r");
+	if (!file) {
+		LOG(LOG_ERROR, "Can't open \"%s\": %s", path, strerror(errno));
+		return -errno;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		LOG(LOG_ERROR, "socketpair: %s", strerror(errno));
+		fclose(file);
+		return -errno;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		LOG(LOG_ERROR, "fork: %s", strerror(errno));
+		fclose(file);
+		close(sv[0]);
+		close(sv[1]);
+		return -errno;
+	}
+
+	if (pid == 0) {
+		close(sv[0]);
+		/* don't outlive the client */
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		signal(SIGINT, SIG_IGN);
+		replay_server(sv[1], file);
+		_exit(0);
+	}
+
+	fclose(file);
+	close(sv[1]);
+	return sv[0];
+}
+
+static struct {
+	FILE *file;
+	int sock;
+	char buf[REPLAY_CHUNK_MAX];
+	int len;
+} g_sim;
+
+int
+replay_sim_open(const char *path)
+{
+	uint64_t ts_us;
+	int sv[2];
+
+	g_sim.file = fopen(path, "r");
+	if (!g_sim.file) {
+		LOG(LOG_ERROR, "Can't open \"%s\": %s", path, strerror(errno));
+		return -errno;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		LOG(LOG_ERROR, "socketpair: %s", strerror(errno));
+		fclose(g_sim.file);
+		return -errno;
+	}
+
+	g_sim.sock = sv[1];
+	fcntl(g_sim.sock, F_SETFL, O_NONBLOCK);
+
+	/* the greeting is there right away */
+	g_sim.len = read_chunk(g_sim.file, g_sim.buf, &ts_us);
+	if (g_sim.len <= 0) {
+		LOG(LOG_ERROR, "the recording doesn't start with a greeting");
+		fclose(g_sim.file);
+		g_sim.file = NULL;
+		close(sv[0]);
+		close(sv[1]);
+		return -EINVAL;
+	}
+	replay_sim_deliver();
+
+	return sv[0];
+}
+
+int
+replay_sim_next(uint64_t *ts_us)
+{
+	g_sim.len = read_chunk(g_sim.file, g_sim.buf, ts_us);
+	if (g_sim.len == 0) {
+		shutdown(g_sim.sock, SHUT_WR);
+	}
+
+	return g_sim.len < 0 ? -EINVAL : g_sim.len;
+}
+
+void
+replay_sim_deliver(void)
+{
+	char drain[4096];
+
+	/* the responses are of no interest */
+	while (read(g_sim.sock, drain, sizeof(drain)) > 0);
+
+	if (write_all(g_sim.sock, g_sim.buf, g_sim.len) != 0) {
+		LOG(LOG_ERROR, "replay write failed: %s", strerror(errno));
+	}
+}
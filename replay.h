@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_REPLAY
+#define SYNERGY_SERIAL_REPLAY
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A recording is the byte stream received from the synergy server, starting
+ * with its greeting, in chunks as they were received - each preceded by
+ * a big endian u64 timestamp (us since the greeting) and u32 length. */
+
+/** Start appending everything received to the given file */
+int record_init(const char *path);
+void record_write(const void *buf, size_t len);
+
+/** Get a socket that yields the recorded stream as if it was the server.
+ * The responses are discarded. */
+int replay_open(const char *path);
+
+/** Same, but for the simulated clock: nothing is sent until
+ * replay_sim_deliver(), the greeting excepted */
+int replay_sim_open(const char *path);
+/** Read the next chunk and get its timestamp. Returns its length, 0 at the
+ * end of the recording (and the socket is shut down) or negative errno. */
+int replay_sim_next(uint64_t *ts_us);
+/** Send the chunk from the last replay_sim_next() */
+void replay_sim_deliver(void);
+
+#endif /* SYNERGY_SERIAL_REPLAY */
@@ -1,26 +1,63 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <endian.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
 
 #include "serial.h"
+#include "serial_proto.h"
 #include "config.h"
 #include "common.h"
+#include "trace.h"
+#include "stats.h"
+#include "absmap.h"
+#include "sink.h"
+#include "hidg.h"
+#include "clock.h"
+#include "simlink.h"
 
 static int g_fd = -1;
+/* talking to simlink.c instead of g_fd */
+static bool g_simulated;
 static int g_tx_freebufs = CONFIG_SERIAL_TX_SIZE;
+static uint64_t g_ping_sent_us;
+/* as set by the driver */
+static unsigned g_baudrate;
+static int g_parity;
+static int g_txq_budget_us;
+
+/* link quality, see serial_negotiate() */
+static struct {
+	unsigned errors; /**< garbage, lost and mangled bytes so far */
+	unsigned errors_handled;
+	uint32_t fw_overruns;
+	unsigned nechoes_sent;
+	unsigned nechoes;
+	/* the last serial_probe() */
+	unsigned probe_bytes;
+	unsigned probe_errors;
+} g_link;
 
 static int
 serial_set_interface_attribs(int speed, int parity)
 {
-	struct termios tty;
-	if (tcgetattr(g_fd, &tty) != 0) {
-		perror("tcgetattr");
-		return -1;
+	struct termios2 tty;
+	struct serial_struct serinfo;
+
+	if (ioctl(g_fd, TCGETS2, &tty) != 0) {
+		LOG(LOG_ERROR, "TCGETS2: %s", strerror(errno));
+		return -errno;
 	}
 
-	cfsetospeed(&tty, speed);
-	cfsetispeed(&tty, speed);
+	/* any integer baudrate, not just the Bxxx constants */
+	tty.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tty.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tty.c_ospeed = speed;
+	tty.c_ispeed = speed;
 
 	tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;	 // 8-bit chars
 	// disable IGNBRK for mismatched speed tests; otherwise receive break
@@ -29,8 +66,8 @@ serial_set_interface_attribs(int speed, int parity)
 	tty.c_lflag = 0;		 // no signaling chars, no echo,
 							 // no canonical processing
 	tty.c_oflag = 0;		 // no remapping, no delays
-	tty.c_cc[VMIN] = 0;		 // read doesn't block
-	tty.c_cc[VTIME] = 5;	 // 0.5 seconds read timeout
+	tty.c_cc[VMIN] = 0;		 // read doesn't block,
+	tty.c_cc[VTIME] = 0;	 // we poll() for the acks instead
 
 	tty.c_iflag &= ~(IXON | IXOFF | IXANY);	 // shut off xon/xoff ctrl
 
@@ -41,147 +78,1147 @@ serial_set_interface_attribs(int speed, int parity)
 	tty.c_cflag &= ~CSTOPB;
 	tty.c_cflag &= ~CRTSCTS;
 
-	if (tcsetattr(g_fd, TCSANOW, &tty) != 0) {
-		perror("tcsetattr");
-		return -1;
+	if (ioctl(g_fd, TCSETS2, &tty) != 0) {
+		LOG(LOG_ERROR, "TCSETS2: %s", strerror(errno));
+		return -errno;
 	}
+
+	/* the driver may round it to whatever its clock divider can do */
+	g_baudrate = speed;
+	if (ioctl(g_fd, TCGETS2, &tty) == 0) {
+		LOG(LOG_INFO, "baudrate: requested %d, got %u", speed, tty.c_ospeed);
+		g_baudrate = tty.c_ospeed;
+	}
+
+	/* USB-serial drivers (ftdi_sio in particular) otherwise hold the rx
+	 * data until their latency timer expires - that's our acks */
+	if (ioctl(g_fd, TIOCGSERIAL, &serinfo) == 0) {
+		serinfo.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(g_fd, TIOCSSERIAL, &serinfo) != 0) {
+			LOG(LOG_INFO, "can't set ASYNC_LOW_LATENCY: %s", strerror(errno));
+		}
+	} else {
+		LOG(LOG_DEBUG_1, "TIOCGSERIAL not supported: %s", strerror(errno));
+	}
+
 	return 0;
 }
 
 struct serial_msg {
-	uint8_t tag[4];
+	uint8_t op; /**< enum serial_op */
 	uint16_t arg1;
 	uint16_t arg2;
-};
+} __attribute__((packed));
+
+/* messages not written yet; each already has its tx buffer reserved, so
+ * there's never more than CONFIG_SERIAL_TX_SIZE of them */
+static uint8_t g_txq[CONFIG_SERIAL_TX_SIZE * (1 + SERIAL_MAX_PAYLOAD)];
+static unsigned g_txq_len; /**< in bytes */
 
 static int serial_sendmsg(struct serial_msg *msg);
+static int serial_txq_flush(void);
+static void serial_restore(void);
+static void serial_step_down(void);
+static void serial_discard(void);
+
+/* poll() for the acks and such and read them; -ETIMEDOUT if there's none in time */
+static int
+serial_read_uplink(uint8_t *rx, size_t len, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = g_fd, .events = POLLIN };
+	int rc;
+
+	if (g_simulated) {
+		return simlink_read(rx, len, timeout_ms);
+	}
+
+	rc = poll(&pfd, 1, timeout_ms);
+	if (rc <= 0) {
+		return rc < 0 ? -errno : -ETIMEDOUT;
+	}
+
+	rc = read(g_fd, rx, len);
+	if (rc < 0) {
+		return errno == EAGAIN ? 0 : -errno;
+	}
+
+	return rc;
+}
+
+/* the multi-byte uplink message being received */
+static struct {
+	uint8_t type;
+	uint8_t len; /**< 0 if none */
+	uint8_t off;
+	uint8_t buf[16];
+} g_up;
+
+static uint32_t
+load_le32(const uint8_t *buf)
+{
+	uint32_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le32toh(val);
+}
 
+/* All in the low 32 bits of the respective clock, so only the differences
+ * of the same side's timestamps mean anything. The clock offset is just
+ * an estimate, assuming the link is equally fast both ways. */
 static void
+handle_pong(const uint8_t *buf)
+{
+	uint32_t now_us = clock_now_us();
+	uint32_t sent_us = load_le32(&buf[0]);
+	uint32_t fw_rx_us = load_le32(&buf[4]);
+	uint32_t fw_handled_us = load_le32(&buf[8]);
+	uint32_t fw_hid_us = load_le32(&buf[12]);
+	uint32_t rtt_us = now_us - sent_us;
+	uint32_t fw_queue_us = fw_handled_us - fw_rx_us;
+	int32_t offset_us = fw_handled_us - (sent_us + rtt_us / 2);
+
+	STATS_HIST_ADD(&g_stats_ping_rtt_us, rtt_us);
+	STATS_HIST_ADD(&g_stats_fw_queue_us, fw_queue_us);
+	STATS_HIST_ADD(&g_stats_link_delay_us, rtt_us - fw_queue_us);
+	LOG(LOG_DEBUG_1, "ping: rtt %"PRIu32" us, firmware queueing %"PRIu32" us, "
+			"clock offset %"PRId32" us, last hid report %"PRIu32" us before",
+			rtt_us, fw_queue_us, offset_us, fw_handled_us - fw_hid_us);
+}
+
+/* what the i-th byte of the seq-th ECHO should be */
+static uint8_t
+probe_byte(unsigned seq, unsigned i)
+{
+	static const uint8_t pattern[8] = { 0x00, 0xFF, 0x55, 0xAA, 0x0F, 0xF0, 0x01, 0x80 };
+
+	return pattern[i] ^ (uint8_t)(seq * 0x3B);
+}
+
+static void
+handle_echo(const uint8_t *buf)
+{
+	unsigned i;
+
+	for (i = 0; i < 8; i++) {
+		if (buf[i] != probe_byte(g_link.nechoes, i)) {
+			g_link.errors++;
+		}
+	}
+	g_link.nechoes++;
+}
+
+static void
+handle_uplink_msg(void)
+{
+	if (g_up.type == SERIAL_UP_OVERRUNS) {
+		uint32_t count = load_le32(g_up.buf);
+
+		LOG(LOG_ERROR, "the firmware lost %"PRIu32" bytes or messages so far", count);
+		g_link.errors += count - g_link.fw_overruns;
+		g_link.fw_overruns = count;
+	} else if (g_up.type == SERIAL_UP_PONG) {
+		handle_pong(g_up.buf);
+	} else if (g_up.type == SERIAL_UP_ECHO) {
+		handle_echo(g_up.buf);
+	}
+}
+
+/* returns the number of acks, or -1 if the firmware was reset */
+static int
+parse_uplink(const uint8_t *rx, int len)
+{
+	int i, nacks = 0;
+
+	for (i = 0; i < len; i++) {
+		if (g_up.len > 0) {
+			g_up.buf[g_up.off++] = rx[i];
+			if (g_up.off == g_up.len) {
+				handle_uplink_msg();
+				g_up.len = 0;
+			}
+		} else if (rx[i] == SERIAL_UP_ACK) {
+			nacks++;
+		} else if (rx[i] == SERIAL_UP_OVERRUNS || rx[i] == SERIAL_UP_PONG ||
+				rx[i] == SERIAL_UP_ECHO) {
+			g_up.type = rx[i];
+			g_up.len = rx[i] == SERIAL_UP_PONG ? 16 : (rx[i] == SERIAL_UP_ECHO ? 8 : 4);
+			g_up.off = 0;
+		} else if (rx[i] == SERIAL_UP_RESET) {
+			g_up.len = 0;
+			g_link.fw_overruns = 0;
+			return -1;
+		} else {
+			LOG(LOG_ERROR, "unexpected byte from the firmware: %d", rx[i]);
+			g_link.errors++;
+		}
+	}
+
+	return nacks;
+}
+
+/* Nothing was acked in time: a message or its ack got lost, or the firmware
+ * idled back to the boot rate. The credits can't be trusted either way, so
+ * start over at a rate that works, with the firmware's state restored.
+ * If that gets stuck too, just forget what's in flight. */
+static void
+serial_ack_timeout(void)
+{
+	static bool recovering;
+
+	if (recovering) {
+		serial_discard();
+		return;
+	}
+
+	recovering = true;
+	serial_step_down();
+	recovering = false;
+}
+
+/* take a tx buffer, waiting for an ack if there's none; negative errno if
+ * the message can't be sent now */
+static int
 get_free_tx_buf(void)
 {
 	uint8_t rx[CONFIG_SERIAL_TX_SIZE];
-	int i, rc = 0;
+	int rc, nacks = 0;
 
 	if (g_tx_freebufs > 0) {
 		g_tx_freebufs--;
-		return;
+		return 0;
 	}
 
-	while (rc == 0) {
-		rc = read(g_fd, &rx, sizeof(rx));
-		if (rc < 0) {
-			LOG(LOG_ERROR, "read() returned: %s", strerror(errno));
-			return;
+	/* the acks won't come for what's not even sent */
+	serial_txq_flush();
+
+	TRACE_BEGIN(credit_wait, 0);
+	while (nacks == 0) {
+		rc = serial_read_uplink(rx, sizeof(rx), CONFIG_SERIAL_ACK_TIMEOUT_MS);
+		if (rc == -ETIMEDOUT) {
+			TRACE_END(credit_wait, 0);
+			LOG(LOG_ERROR, "no ack from the firmware in %d ms", CONFIG_SERIAL_ACK_TIMEOUT_MS);
+			serial_ack_timeout();
+			/* and now for the message we were called for, if there's room */
+			if (g_tx_freebufs == 0) {
+				return -EIO;
+			}
+			g_tx_freebufs--;
+			return 0;
+		} else if (rc < 0) {
+			/* a signal might be telling us to stop */
+			if (rc != -EINTR) {
+				LOG(LOG_ERROR, "waiting for ack: %s", strerror(-rc));
+			}
+			TRACE_END(credit_wait, 0);
+			return rc;
+		}
+
+		nacks = parse_uplink(rx, rc);
+		if (nacks < 0) {
+			TRACE_END(credit_wait, 0);
+			LOG(LOG_INFO, "the firmware was reset, restoring its state");
+			g_tx_freebufs = CONFIG_SERIAL_TX_SIZE;
+			serial_restore();
+			/* and now for the message we were called for */
+			return get_free_tx_buf();
 		}
 	}
+	TRACE_END(credit_wait, nacks);
+	TRACE_INSTANT(serial_ack, nacks);
 
-	for (i = 0; i < rc; i++) {
-		if (rx[i] == 0xFF) {
-			g_tx_freebufs = CONFIG_SERIAL_TX_SIZE - 1;
-			serial_sendmsg(&(struct serial_msg){ "SCFG", CONFIG_SCREENW, CONFIG_SCREENH });
-			return;
-		} else if (rx[i] != 0x01) {
-			LOG(LOG_ERROR, "read() returned non-1: %d", rx[i]);
+	g_tx_freebufs += nacks - 1;
+	return 0;
+}
+
+int
+serial_poll(void)
+{
+	uint8_t rx[32];
+	int rc, nacks;
+
+	if (g_fd < 0 && !g_simulated) {
+		return 0;
+	}
+
+	rc = serial_read_uplink(rx, sizeof(rx), 0);
+	if (rc == -ETIMEDOUT || rc == -EINTR) {
+		return 0;
+	} else if (rc < 0) {
+		return rc;
+	}
+
+	nacks = parse_uplink(rx, rc);
+	if (nacks < 0) {
+		LOG(LOG_INFO, "the firmware was reset, restoring its state");
+		/* what's still queued is in the snapshots already, and it
+		 * wouldn't fit along with them anyway */
+		g_txq_len = 0;
+		g_tx_freebufs = CONFIG_SERIAL_TX_SIZE;
+		serial_restore();
+		return serial_txq_flush();
+	}
+
+	g_tx_freebufs += nacks;
+	if (g_link.errors != g_link.errors_handled && g_baudrate > SERIAL_BOOT_BAUDRATE) {
+		serial_step_down();
+	}
+	g_link.errors_handled = g_link.errors;
+	return 0;
+}
+
+void
+serial_set_txq_budget(int us)
+{
+	g_txq_budget_us = us;
+}
+
+/* Whether the bytes already written but not on the wire yet (in the tty
+ * layer, not counting the USB-serial adapter's own buffer) take more than
+ * the budget to send. Anything coalescable written now would only wait
+ * behind them, and delay the keys and clicks that come after it. */
+static bool
+serial_txq_over_budget(void)
+{
+	int depth;
+
+	if (g_txq_budget_us <= 0) {
+		return false;
+	}
+
+	if (g_simulated) {
+		depth = simlink_outq();
+	} else if (ioctl(g_fd, TIOCOUTQ, &depth) != 0) {
+		LOG(LOG_ERROR, "TIOCOUTQ: %s, not holding anything back", strerror(errno));
+		g_txq_budget_us = 0;
+		return false;
+	}
+
+	STATS_HIST_ADD(&g_stats_txq_depth, depth);
+	/* 8n1 */
+	return (uint64_t)depth * 10 * 1000000 > (uint64_t)g_txq_budget_us * g_baudrate;
+}
+
+/* a probe every now and then, see handle_pong(); -1 if it's not time yet */
+static int
+serial_ping_kick(void)
+{
+	uint64_t now_us = clock_now_us();
+
+	if (now_us - g_ping_sent_us < CONFIG_SERIAL_PING_INTERVAL_MS * 1000) {
+		return -1;
+	}
+
+	g_ping_sent_us = now_us;
+	return serial_sendmsg(&(struct serial_msg){ SERIAL_OP_PING, (uint16_t)now_us, (uint16_t)(now_us >> 16) });
+}
+
+static int
+serial_write(const void *buf, size_t len)
+{
+	size_t off = 0;
+	ssize_t rc;
+
+	if (g_simulated) {
+		simlink_write(buf, len);
+		return 0;
+	}
+
+	while (off < len) {
+		rc = write(g_fd, (const char *)buf + off, len - off);
+		if (rc < 0) {
+			if (errno == EAGAIN) {
+				/* the tty buffer is full, wait for it to drain */
+				struct pollfd pfd = { .fd = g_fd, .events = POLLOUT };
+				poll(&pfd, 1, -1);
+				continue;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
 		}
+		off += rc;
 	}
 
-	g_tx_freebufs += rc - 1;
+	return 0;
 }
 
+/* all the queued messages go out in a single write */
 static int
-serial_sendmsg(struct serial_msg *msg)
+serial_txq_flush(void)
 {
-	int8_t rc;
+	unsigned len = g_txq_len;
+	int rc;
 
-	get_free_tx_buf();
+	if (g_txq_len == 0) {
+		return 0;
+	}
+
+	g_txq_len = 0;
+	g_sink->nwrites++;
 
-	rc = write(g_fd, (char *)msg, sizeof(*msg));
+	TRACE_BEGIN(serial_write, len);
+	rc = serial_write(g_txq, len);
+	TRACE_END(serial_write, rc);
 	if (rc < 0) {
-		return -errno;
+		return rc;
+	}
+
+	if (g_stats_last_recv_us) {
+		STATS_HIST_ADD(&g_stats_recv_to_write_us, clock_now_us() - g_stats_last_recv_us);
+		g_stats_last_recv_us = 0;
+	}
+
+	clock_sleep_us(1600);
+
+	return 0;
+}
+
+static int
+serial_queue(const void *msg, unsigned len)
+{
+	int rc;
+
+	rc = get_free_tx_buf();
+	if (rc < 0) {
+		return rc;
+	}
+
+	memcpy(&g_txq[g_txq_len], msg, len);
+	g_txq_len += len;
+	g_sink->nmsgs++;
+	return 0;
+}
+
+static int
+serial_sendmsg(struct serial_msg *msg)
+{
+	return serial_queue(msg, sizeof(*msg));
+}
+
+/* send the bytes of the report that differ from what was sent last */
+static void
+serial_send_report(uint8_t op, const void *report, void *sent, unsigned len)
+{
+	uint8_t msg[1 + SERIAL_MAX_PAYLOAD] = { op };
+	unsigned i, msg_len = 2;
+
+	for (i = 0; i < len; i++) {
+		if (((const uint8_t *)report)[i] != ((uint8_t *)sent)[i]) {
+			msg[1] |= 1 << i;
+			msg[msg_len++] = ((const uint8_t *)report)[i];
+		}
 	}
 
-	usleep(1600);
+	if (msg[1] == 0) {
+		return;
+	}
+
+	if (serial_queue(msg, msg_len) == 0) {
+		memcpy(sent, report, len);
+	}
+}
+
+static const unsigned g_baudrates[] = { CONFIG_SERIAL_BAUDRATES };
+
+static int
+serial_set_speed(unsigned rate)
+{
+	if (g_simulated) {
+		/* simlink.c follows the BAUD messages on its own */
+		g_baudrate = rate;
+		return 0;
+	}
+	return serial_set_interface_attribs(rate, g_parity);
+}
+
+/* forget whatever's in flight, it's garbage, and pause long enough for
+ * the firmware to drop any message it's still waiting the rest of */
+static void
+serial_discard(void)
+{
+	if (!g_simulated) {
+		ioctl(g_fd, TCFLSH, TCIOFLUSH);
+	}
+	clock_sleep_us(SERIAL_RESYNC_US * 2 + 20000000ULL / g_baudrate);
+	g_txq_len = 0;
+	g_tx_freebufs = CONFIG_SERIAL_TX_SIZE;
+	g_up.len = 0;
+	g_link.nechoes_sent = g_link.nechoes = 0;
+}
+
+/* wait for all the acks and echoes */
+static int
+serial_settle(int timeout_ms)
+{
+	uint64_t deadline_us = clock_now_us() + timeout_ms * 1000ULL;
+	uint8_t rx[64];
+	int rc, nacks;
+
+	while (g_tx_freebufs < CONFIG_SERIAL_TX_SIZE || g_link.nechoes < g_link.nechoes_sent) {
+		uint64_t now_us = clock_now_us();
+
+		if (now_us >= deadline_us) {
+			return -ETIMEDOUT;
+		}
+
+		rc = serial_read_uplink(rx, sizeof(rx), (deadline_us - now_us + 999) / 1000);
+		if (rc == -ETIMEDOUT || rc == -EINTR) {
+			continue;
+		} else if (rc < 0) {
+			return rc;
+		}
+
+		nacks = parse_uplink(rx, rc);
+		if (nacks < 0) {
+			/* back at the boot rate, with nothing in flight */
+			serial_set_speed(SERIAL_BOOT_BAUDRATE);
+			serial_discard();
+			return -ECONNRESET;
+		}
+
+		g_tx_freebufs += nacks;
+		if (g_tx_freebufs > CONFIG_SERIAL_TX_SIZE) {
+			/* garbage that looked like acks */
+			g_link.errors += g_tx_freebufs - CONFIG_SERIAL_TX_SIZE;
+			g_tx_freebufs = CONFIG_SERIAL_TX_SIZE;
+		}
+	}
 
 	return 0;
 }
 
+/* Bounce nechoes test patterns off the firmware at the current rate;
+ * returns how many of their bytes came back wrong, or not at all */
+static unsigned
+serial_probe(unsigned nechoes)
+{
+	unsigned errors = g_link.errors;
+	uint8_t msg[1 + 8];
+	unsigned i;
+
+	g_link.nechoes_sent = g_link.nechoes = 0;
+	while (g_link.nechoes_sent < nechoes) {
+		while (g_tx_freebufs > 0 && g_link.nechoes_sent < nechoes) {
+			msg[0] = SERIAL_OP_ECHO;
+			for (i = 0; i < 8; i++) {
+				msg[1 + i] = probe_byte(g_link.nechoes_sent, i);
+			}
+			serial_queue(msg, sizeof(msg));
+			g_link.nechoes_sent++;
+		}
+
+		serial_txq_flush();
+		if (serial_settle(CONFIG_SERIAL_PROBE_TIMEOUT_MS) < 0) {
+			break;
+		}
+	}
+
+	if (g_link.nechoes < nechoes) {
+		g_link.errors += (nechoes - g_link.nechoes) * 8;
+		serial_discard();
+	}
+
+	g_link.nechoes_sent = g_link.nechoes = 0;
+	g_link.probe_bytes = nechoes * 8;
+	g_link.probe_errors = g_link.errors - errors;
+	/* not for serial_poll() to act on */
+	g_link.errors_handled = g_link.errors;
+	return g_link.probe_errors;
+}
+
+/* Move both ends to the given rate and check the link there. Unless it's
+ * confirmed, the firmware goes back to the previous rate on its own. */
+static int
+serial_try_baudrate(unsigned rate)
+{
+	unsigned prev = g_baudrate;
+	int rc;
+
+	serial_sendmsg(&(struct serial_msg){ SERIAL_OP_BAUD, (uint16_t)rate, (uint16_t)(rate >> 16) });
+	serial_txq_flush();
+	rc = serial_settle(CONFIG_SERIAL_PROBE_TIMEOUT_MS);
+	if (rc == 0) {
+		serial_set_speed(rate);
+		if (serial_probe(CONFIG_SERIAL_PROBE_ECHOES) == 0) {
+			serial_sendmsg(&(struct serial_msg){ SERIAL_OP_BAUD, (uint16_t)rate, (uint16_t)(rate >> 16) });
+			serial_txq_flush();
+			rc = serial_settle(CONFIG_SERIAL_PROBE_TIMEOUT_MS);
+			if (rc == 0) {
+				return 0;
+			}
+		}
+	}
+
+	if (rc == -ECONNRESET) {
+		return rc;
+	}
+
+	/* wait until it gives up on the new rate */
+	clock_sleep_us(SERIAL_BAUD_TRIAL_MS * 1000 * 2);
+	serial_set_speed(prev);
+	serial_discard();
+	return -EIO;
+}
+
+/* Find the firmware at the rate it starts with (or goes back to when left
+ * alone), then step up through CONFIG_SERIAL_BAUDRATES for as long as each
+ * rate passes a probe without a single error. With a non-zero rate given,
+ * that's the only one tried. */
+static void
+serial_negotiate(unsigned want)
+{
+	uint64_t deadline_us = clock_now_us() + (SERIAL_BAUD_IDLE_MS + 1000) * 1000ULL;
+	unsigned i;
+
+	serial_set_speed(SERIAL_BOOT_BAUDRATE);
+	serial_discard();
+	while (serial_probe(CONFIG_SERIAL_TX_SIZE) > 0) {
+		if (clock_now_us() >= deadline_us) {
+			LOG(LOG_ERROR, "the firmware doesn't respond at %u baud", SERIAL_BOOT_BAUDRATE);
+			return;
+		}
+	}
+
+	if (want && want != g_baudrate && serial_try_baudrate(want) < 0) {
+		LOG(LOG_ERROR, "%u baud doesn't work, staying at %u", want, g_baudrate);
+	}
+
+	for (i = 0; !want && i < sizeof(g_baudrates) / sizeof(g_baudrates[0]); i++) {
+		if (g_baudrates[i] <= g_baudrate) {
+			continue;
+		}
+
+		if (serial_try_baudrate(g_baudrates[i]) < 0) {
+			LOG(LOG_INFO, "%u baud doesn't work, staying at %u", g_baudrates[i], g_baudrate);
+			break;
+		}
+	}
+
+	/* a longer one, for the numbers */
+	serial_probe(CONFIG_SERIAL_PROBE_ECHOES * 4);
+}
+
+/* Errors at a rate that checked out before: try one step down. If even
+ * that doesn't get through, the firmware soon idles back to the boot rate.
+ * Either way, some input might have been lost or mangled on the way. */
+static void
+serial_step_down(void)
+{
+	unsigned rate = SERIAL_BOOT_BAUDRATE;
+	unsigned i;
+	int rc;
+
+	for (i = 0; i < sizeof(g_baudrates) / sizeof(g_baudrates[0]); i++) {
+		if (g_baudrates[i] < g_baudrate && g_baudrates[i] > rate) {
+			rate = g_baudrates[i];
+		}
+	}
+
+	LOG(LOG_ERROR, "errors at %u baud, falling back to %u", g_baudrate, rate);
+	/* the firmware might be out of step with the messages, too */
+	serial_settle(CONFIG_SERIAL_PROBE_TIMEOUT_MS);
+	serial_discard();
+	rc = serial_try_baudrate(rate);
+	if (rc == -EIO) {
+		clock_sleep_us(SERIAL_BAUD_IDLE_MS * 1000 * 2);
+		serial_set_speed(SERIAL_BOOT_BAUDRATE);
+		serial_discard();
+	}
+
+	serial_sendmsg(&(struct serial_msg){ SERIAL_OP_LEAV });
+	serial_restore();
+	serial_txq_flush();
+}
+
 void
-serial_set_fd(int fd, int speed, int parity, int should_block)
+serial_get_link_quality(unsigned *baudrate, unsigned *nbytes, unsigned *nerrors)
 {
-	g_fd = fd;
-	serial_set_interface_attribs(speed, parity);
-	serial_sendmsg(&(struct serial_msg){ "SCFG", CONFIG_SCREENW, CONFIG_SCREENH });
+	*baudrate = g_baudrate;
+	*nbytes = g_link.probe_bytes;
+	*nerrors = g_link.probe_errors;
 }
 
-static int16_t g_x_delta, g_y_delta;
-static int16_t g_x = -1, g_y = -1;
+int
+serial_set_fd(int fd, int speed, int parity)
+{
+	int rc;
+
+	g_fd = fd;
+	g_parity = parity;
+	absmap_init();
+	rc = serial_set_interface_attribs(SERIAL_BOOT_BAUDRATE, parity);
+	if (rc < 0) {
+		return rc;
+	}
+
+	serial_negotiate(speed);
+	serial_sendmsg(&(struct serial_msg){ SERIAL_OP_SCFG, CONFIG_SCREENW, CONFIG_SCREENH });
+	return serial_txq_flush();
+}
 
 int
-serial_ard_set_mouse_pos(uint16_t x, uint16_t y)
+serial_set_simulated(int speed)
+{
+	g_simulated = true;
+	absmap_init();
+	simlink_init(SERIAL_BOOT_BAUDRATE);
+
+	serial_negotiate(speed);
+	serial_sendmsg(&(struct serial_msg){ SERIAL_OP_SCFG, CONFIG_SCREENW, CONFIG_SCREENH });
+	return serial_txq_flush();
+}
+
+static int32_t g_x_delta, g_y_delta;
+/* the last absolute position, not sent yet if g_pos_pending */
+static uint16_t g_x, g_y;
+static bool g_pos_pending;
+/* when the oldest of the above was received, for the stats */
+static uint64_t g_move_recv_us;
+/* Relative moves only come from the server while a game or such has the
+ * pointer locked. Until the next absolute one, they go to the firmware's
+ * relative mouse as they come, instead of into the next tick's absolute
+ * position. */
+static bool g_rel_mouse = true;
+static bool g_rel_mode;
+
+void
+serial_set_rel_mouse(bool enable)
+{
+	g_rel_mouse = enable;
+}
+/* raw wheel deltas (CONFIG_WHEEL_DELTA_PER_NOTCH per notch) not sent yet */
+static int32_t g_wheel_x, g_wheel_y;
+/* the key being auto-repeated by the firmware, 0 if none */
+static uint16_t g_repeat_key;
+
+/* What the firmware should have by now, to bring it back after a reset.
+ * It starts with nothing held and the pointer at 0,0 - just like this. */
+static struct {
+	bool entered; /**< on our screen, so the pointer position matters */
+	uint16_t x, y; /**< in the HID logical range */
+	uint8_t buttons;
+	uint16_t keys[16];
+	unsigned nkeys;
+} g_snap;
+
+static void
+snap_key(uint16_t id, bool down)
 {
+	unsigned i;
+
+	for (i = 0; i < g_snap.nkeys && g_snap.keys[i] != id; i++);
+
+	if (down && i == g_snap.nkeys && i < sizeof(g_snap.keys) / sizeof(g_snap.keys[0])) {
+		g_snap.keys[g_snap.nkeys++] = id;
+	} else if (!down && i < g_snap.nkeys) {
+		g_snap.keys[i] = g_snap.keys[--g_snap.nkeys];
+	}
+}
+
+static uint16_t
+snap_clamp(int32_t v)
+{
+	return v < 0 ? 0 : (v > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : v);
+}
+
+static int16_t
+delta_clamp(int32_t v)
+{
+	return v < -32767 ? -32767 : (v > 32767 ? 32767 : v);
+}
+
+static void
+move_sent(void)
+{
+	STATS_HIST_ADD(&g_stats_move_recv_to_write_us, clock_now_us() - g_move_recv_us);
+	g_x_delta = 0;
+	g_y_delta = 0;
+	g_move_recv_us = 0;
+}
+
+/* whatever relative movement is pending, for the relative mouse */
+static int
+rel_send(void)
+{
+	int rc;
+
+	if (!g_x_delta && !g_y_delta) {
+		return -1;
+	}
+
+	rc = serial_sendmsg(&(struct serial_msg){ SERIAL_OP_RMOV,
+			delta_clamp(g_x_delta), delta_clamp(g_y_delta) });
+	move_sent();
+	return rc;
+}
+
+static int
+serial_sink_set_pos(struct sink *sink, uint16_t x, uint16_t y)
+{
+	if (g_rel_mode) {
+		LOG(LOG_DEBUG_1, "absolute mouse moves again");
+		rel_send();
+		g_rel_mode = false;
+	}
+
+	g_snap.entered = true;
 	g_x = x;
 	g_y = y;
+	g_pos_pending = true;
 	return 0;
 }
 
-int
-serial_ard_mouse_move(int16_t x_delta, int16_t y_delta)
+static int
+serial_sink_move(struct sink *sink, int16_t x_delta, int16_t y_delta)
 {
+	if (!g_move_recv_us && (x_delta || y_delta)) {
+		g_move_recv_us = clock_now_us();
+	}
 	g_x_delta += x_delta;
 	g_y_delta += y_delta;
+	if (!g_x_delta && !g_y_delta) {
+		/* back where it was, nothing to send */
+		g_move_recv_us = 0;
+	}
+
+	if (g_rel_mouse && !g_rel_mode) {
+		LOG(LOG_DEBUG_1, "relative mouse moves, passing them through");
+		g_rel_mode = true;
+	}
 	return 0;
 }
 
-int
-serial_ard_kick_mouse_move(void)
+/* at the end of each batch, unless there's a backlog - then it merges
+ * until there isn't */
+static void
+rel_commit(void)
+{
+	if (g_rel_mode && (g_x_delta || g_y_delta) && !serial_txq_over_budget()) {
+		rel_send();
+	}
+}
+
+static int
+serial_sink_flush(struct sink *sink)
 {
+	int8_t wheel_x, wheel_y;
 	int rc = -1;
 
-	if (g_x_delta || g_y_delta) {
-		rc = serial_sendmsg(&(struct serial_msg){ "MMOV", g_x_delta, g_y_delta });
-		g_x_delta = 0;
-		g_y_delta = 0;
-	} else if (g_x > 0 || g_y > 0) {
-		rc = serial_sendmsg(&(struct serial_msg){ "MSET", g_x, g_y });
-		g_x = -1;
-		g_y = -1;
+	/* it all merges into the next tick's messages; the ping waits too, it
+	 * would only queue up behind the backlog */
+	if (serial_txq_over_budget()) {
+		return 0;
+	}
+
+	/* both already in the HID logical range, so the firmware just copies
+	 * them into the report */
+	if (g_rel_mode) {
+		rc = rel_send();
+	} else if (g_x_delta || g_y_delta) {
+		int16_t hid_dx, hid_dy;
+
+		absmap_delta(delta_clamp(g_x_delta), delta_clamp(g_y_delta), &hid_dx, &hid_dy);
+		rc = serial_sendmsg(&(struct serial_msg){ SERIAL_OP_MMOV, hid_dx, hid_dy });
+		g_snap.x = snap_clamp((int32_t)g_snap.x + hid_dx);
+		g_snap.y = snap_clamp((int32_t)g_snap.y + hid_dy);
+		move_sent();
+	} else if (g_pos_pending) {
+		uint16_t hid_x, hid_y;
+
+		absmap_point(g_x, g_y, &hid_x, &hid_y);
+		rc = serial_sendmsg(&(struct serial_msg){ SERIAL_OP_MSET, hid_x, hid_y });
+		g_snap.x = hid_x;
+		g_snap.y = hid_y;
+		g_pos_pending = false;
+	}
+
+	wheel_x = sink_take_wheel_notches(&g_wheel_x);
+	wheel_y = sink_take_wheel_notches(&g_wheel_y);
+	if (wheel_x || wheel_y) {
+		rc = serial_sendmsg(&(struct serial_msg){ SERIAL_OP_MWHL, wheel_x, wheel_y });
+	}
+
+	if (serial_ping_kick() >= 0) {
+		rc = 0;
 	}
 
 	return rc;
 }
 
-int
-serial_ard_mouse_down(uint8_t id)
+static int
+serial_sink_button(struct sink *sink, uint8_t id, bool down)
 {
-	return serial_sendmsg(&(struct serial_msg){ "MBDN", id });
+	/* clicks where the pointer was moved to */
+	if (g_rel_mode) {
+		rel_send();
+	}
+
+	if (down) {
+		g_snap.buttons |= id;
+		return serial_sendmsg(&(struct serial_msg){ SERIAL_OP_MBDN, id });
+	}
+	g_snap.buttons &= ~id;
+	return serial_sendmsg(&(struct serial_msg){ SERIAL_OP_MBUP, id });
 }
 
-int
-serial_ard_mouse_up(uint8_t id)
+static int
+serial_sink_wheel(struct sink *sink, int16_t x_delta, int16_t y_delta)
 {
-	return serial_sendmsg(&(struct serial_msg){ "MBUP", id });
+	g_wheel_x += x_delta;
+	g_wheel_y += y_delta;
+	return 0;
 }
 
-int
-serial_ard_mouse_wheel(int16_t x_delta, int16_t y_delta)
+static int
+serial_sink_key(struct sink *sink, uint16_t id, bool down)
 {
-	return serial_sendmsg(&(struct serial_msg){ "MWHL", x_delta, y_delta });
+	/* the firmware stops repeating on any other key press */
+	if (down || g_repeat_key == id) {
+		g_repeat_key = 0;
+	}
+
+	snap_key(id, down);
+	if (down) {
+		return serial_sendmsg(&(struct serial_msg){ SERIAL_OP_KBDN, id });
+	}
+	return serial_sendmsg(&(struct serial_msg){ SERIAL_OP_KBUP, id });
 }
 
-int
-serial_ard_key_down(uint16_t id)
+static int
+serial_sink_key_repeat(struct sink *sink, uint16_t id)
 {
-	return serial_sendmsg(&(struct serial_msg){ "KBDN", id });
+	if (g_repeat_key == id) {
+		/* the firmware is already repeating it on its own */
+		return 0;
+	}
+
+	g_repeat_key = id;
+	return serial_sendmsg(&(struct serial_msg){ SERIAL_OP_KRPT, id, CONFIG_KEY_REPEAT_INTERVAL_MS });
 }
 
-int
-serial_ard_key_up(uint16_t id)
+static int
+serial_sink_release_all(struct sink *sink)
 {
-	return serial_sendmsg(&(struct serial_msg){ "KBUP", id });
+	/* everything was released one by one already */
+	g_snap.entered = false;
+	return 0;
 }
 
-int
-serial_ard_all_up(void)
+static int
+serial_sink_commit(struct sink *sink)
+{
+	rel_commit();
+	return serial_txq_flush();
+}
+
+static const struct sink_ops g_serial_sink_ops = {
+	.move = serial_sink_move,
+	.set_pos = serial_sink_set_pos,
+	.button = serial_sink_button,
+	.wheel = serial_sink_wheel,
+	.key = serial_sink_key,
+	.key_repeat = serial_sink_key_repeat,
+	.release_all = serial_sink_release_all,
+	.flush = serial_sink_flush,
+	.commit = serial_sink_commit,
+};
+
+struct sink g_serial_sink = {
+	.name = "serial",
+	.ops = &g_serial_sink_ops,
+};
+
+/* The raw mode: the full reports are kept here and the firmware just
+ * forwards them. Key and button changes in the same batch go out as one
+ * report, unless they conflict (e.g. a press and a release), so that no
+ * state is skipped. The report IDs aren't sent. */
+static struct hidg_keyboard_report g_raw_kbd, g_raw_kbd_sent;
+static struct hidg_mouse_report g_raw_mouse, g_raw_mouse_sent;
+static uint16_t g_raw_x, g_raw_y;
+/* 1 if key presses are pending, -1 if releases, 0 if nothing */
+static int g_raw_keys_dir;
+static bool g_raw_buttons_dirty;
+
+static void
+raw_send_keys(void)
+{
+	serial_send_report(SERIAL_OP_KREP, &g_raw_kbd.modifiers, &g_raw_kbd_sent.modifiers,
+			sizeof(g_raw_kbd) - 1);
+	g_raw_keys_dir = 0;
+}
+
+static void
+raw_send_mouse(void)
+{
+	g_raw_mouse.x = htole16(g_raw_x);
+	g_raw_mouse.y = htole16(g_raw_y);
+	serial_send_report(SERIAL_OP_MREP, &g_raw_mouse.buttons, &g_raw_mouse_sent.buttons,
+			sizeof(g_raw_mouse) - 1);
+	g_raw_buttons_dirty = false;
+
+	/* it's relative, both sides forget it once it's sent */
+	g_raw_mouse.wheel = 0;
+	g_raw_mouse_sent.wheel = 0;
+}
+
+static int
+serial_raw_sink_button(struct sink *sink, uint8_t id, bool down)
+{
+	if (g_rel_mode) {
+		rel_send();
+	}
+	if (g_raw_keys_dir) {
+		raw_send_keys();
+	}
+	if (g_raw_buttons_dirty) {
+		raw_send_mouse();
+	}
+
+	if (down) {
+		g_raw_mouse.buttons |= id;
+	} else {
+		g_raw_mouse.buttons &= ~id;
+	}
+	g_raw_buttons_dirty = true;
+	return 0;
+}
+
+static int
+serial_raw_sink_key(struct sink *sink, uint16_t id, bool down)
 {
-	return serial_sendmsg(&(struct serial_msg){ "LEAV" });
+	int dir = down ? 1 : -1;
+
+	if (g_raw_buttons_dirty) {
+		raw_send_mouse();
+	}
+	if (g_raw_keys_dir && g_raw_keys_dir != dir) {
+		raw_send_keys();
+	}
+
+	if (hidg_keyboard_report_key(&g_raw_kbd, id, down)) {
+		g_raw_keys_dir = dir;
+	}
+	return 0;
+}
+
+static int
+serial_raw_sink_release_all(struct sink *sink)
+{
+	g_raw_kbd.modifiers = 0;
+	memset(g_raw_kbd.keys, 0, sizeof(g_raw_kbd.keys));
+	g_raw_mouse.buttons = 0;
+	raw_send_keys();
+	raw_send_mouse();
+	return 0;
+}
+
+static int
+serial_raw_sink_flush(struct sink *sink)
+{
+	int8_t wheel_x, wheel_y;
+	int32_t x, y;
+
+	if (serial_txq_over_budget()) {
+		return 0;
+	}
+
+	if (g_rel_mode) {
+		rel_send();
+	} else if (g_x_delta || g_y_delta) {
+		int16_t hid_dx, hid_dy;
+
+		absmap_delta(delta_clamp(g_x_delta), delta_clamp(g_y_delta), &hid_dx, &hid_dy);
+		x = g_raw_x + hid_dx;
+		y = g_raw_y + hid_dy;
+		g_raw_x = x < 0 ? 0 : (x > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : x);
+		g_raw_y = y < 0 ? 0 : (y > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : y);
+		move_sent();
+	} else if (g_pos_pending) {
+		absmap_point(g_x, g_y, &g_raw_x, &g_raw_y);
+		g_pos_pending = false;
+	}
+
+	wheel_x = sink_take_wheel_notches(&g_wheel_x);
+	wheel_y = sink_take_wheel_notches(&g_wheel_y);
+	g_raw_mouse.wheel = wheel_y;
+	raw_send_mouse();
+
+	if (wheel_x) {
+		/* there's no horizontal wheel in the absolute mouse report, but
+		 * shift + wheel scrolls horizontally pretty much everywhere */
+		uint8_t modifiers = g_raw_kbd.modifiers;
+
+		g_raw_kbd.modifiers |= 1 << (HID_USAGE_LEFT_SHIFT - 0xE0);
+		raw_send_keys();
+		g_raw_mouse.wheel = -wheel_x;
+		raw_send_mouse();
+		g_raw_kbd.modifiers = modifiers;
+		raw_send_keys();
+	}
+
+	serial_ping_kick();
+	return 0;
+}
+
+static int
+serial_raw_sink_commit(struct sink *sink)
+{
+	raw_send_keys();
+	if (g_raw_buttons_dirty) {
+		raw_send_mouse();
+	}
+	rel_commit();
+	return serial_txq_flush();
+}
+
+/* the USB host repeats the held keys on its own */
+static const struct sink_ops g_serial_raw_sink_ops = {
+	.move = serial_sink_move,
+	.set_pos = serial_sink_set_pos,
+	.button = serial_raw_sink_button,
+	.wheel = serial_sink_wheel,
+	.key = serial_raw_sink_key,
+	.release_all = serial_raw_sink_release_all,
+	.flush = serial_raw_sink_flush,
+	.commit = serial_raw_sink_commit,
+};
+
+struct sink g_serial_raw_sink = {
+	.name = "serial-raw",
+	.ops = &g_serial_raw_sink_ops,
+};
+
+/* The firmware was reset and lost everything (or we can't be sure what it
+ * got): put back what should be held and where the pointer is, all in one
+ * burst. Nothing that's merely pending is lost either, as it's only applied
+ * to the state snapshots when sent. */
+static void
+serial_restore(void)
+{
+	unsigned i;
+
+	TRACE_INSTANT(serial_restore, g_snap.nkeys);
+	serial_sendmsg(&(struct serial_msg){ SERIAL_OP_SCFG, CONFIG_SCREENW, CONFIG_SCREENH });
+
+	if (g_sink == &g_serial_raw_sink) {
+		/* the full reports, as the firmware has none of the bytes */
+		memset(&g_raw_kbd_sent, 0, sizeof(g_raw_kbd_sent));
+		memset(&g_raw_mouse_sent, 0, sizeof(g_raw_mouse_sent));
+		raw_send_keys();
+		raw_send_mouse();
+		return;
+	}
+
+	if (g_snap.entered) {
+		serial_sendmsg(&(struct serial_msg){ SERIAL_OP_MSET, g_snap.x, g_snap.y });
+	}
+	if (g_snap.buttons) {
+		serial_sendmsg(&(struct serial_msg){ SERIAL_OP_MBDN, g_snap.buttons });
+	}
+	for (i = 0; i < g_snap.nkeys; i++) {
+		serial_sendmsg(&(struct serial_msg){ SERIAL_OP_KBDN, g_snap.keys[i] });
+	}
+	if (g_repeat_key) {
+		serial_sendmsg(&(struct serial_msg){ SERIAL_OP_KRPT, g_repeat_key, CONFIG_KEY_REPEAT_INTERVAL_MS });
+	}
 }
@@ -2,21 +2,39 @@
 #define SYNERGY_SERIAL
 
 #include <unistd.h>
-#include <termios.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 
-void serial_set_fd(int fd, int speed, int parity, int should_block);
-
-int serial_ard_set_mouse_pos(uint16_t x, uint16_t y);
-int serial_ard_mouse_move(int16_t x_delta, int16_t y_delta);
-int serial_ard_kick_mouse_move(void);
-int serial_ard_mouse_down(uint8_t id);
-int serial_ard_mouse_up(uint8_t id);
-int serial_ard_mouse_wheel(int16_t x_delta, int16_t y_delta);
-int serial_ard_key_down(uint16_t id);
-int serial_ard_key_up(uint16_t id);
-int serial_ard_all_up(void);
+#include "sink.h"
+
+/** Configure the serial port at fd and move the firmware to the given
+ * baudrate (any integer), or to the fastest one that works if 0 */
+int serial_set_fd(int fd, int speed, int parity);
+/** Talk to the simulated link and firmware instead (see simlink.h) */
+int serial_set_simulated(int speed);
+
+/** The baudrate the link ended up at, and how many bytes of the test
+ * pattern came back wrong (or not at all) there */
+void serial_get_link_quality(unsigned *baudrate, unsigned *nbytes, unsigned *nerrors);
+
+/** Hold back mouse moves and scrolls while the kernel has more than this
+ * queued for the wire, in microseconds at the current baudrate. 0 to never
+ * hold them back. */
+void serial_set_txq_budget(int us);
+
+/** Whether relative moves go to the firmware's relative mouse right away
+ * (the default), or into the absolute position on the next tick */
+void serial_set_rel_mouse(bool enable);
+
+/** Handle whatever the firmware sent (acks, probe replies), without
+ * waiting. To be called when the serial fd is readable. */
+int serial_poll(void);
+
+/** The sink writing to the serial port set up with serial_set_fd() */
+extern struct sink g_serial_sink;
+/** The same, but sending raw HID reports for the firmware to forward */
+extern struct sink g_serial_raw_sink;
 
 #endif /* SYNERGY_SERIAL */
\ No newline at end of file
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_PROTO
+#define SYNERGY_SERIAL_PROTO
+
+#include <stdint.h>
+
+/* What goes over the UART, shared by serial.c and arduino.ino.
+ *
+ * Host to firmware: a one byte opcode, then a payload of a fixed size for
+ * that opcode, little endian. Listed as OP(name, payload_len), in opcode
+ * order; the firmware dispatches through a table indexed by the opcode.
+ * Each message is acked once it's handled.
+ *
+ * KREP and MREP carry raw HID reports, sent verbatim by the firmware. Only
+ * the bytes that changed since the previous one are sent: the payload is
+ * a bitmask of the report bytes that follow, then just those bytes.
+ *
+ * The firmware starts at SERIAL_BOOT_BAUDRATE. After acking a BAUD it
+ * switches to the new rate, and goes back unless another BAUD for that
+ * rate confirms it within SERIAL_BAUD_TRIAL_MS. At any other rate, it goes
+ * back to SERIAL_BOOT_BAUDRATE after SERIAL_BAUD_IDLE_MS without a message
+ * (the host pings more often than that), so a new host session can always
+ * reach it.
+ *
+ * A message never has a gap of SERIAL_RESYNC_US plus two byte times in the
+ * middle. The firmware drops a message that does, so after line noise the
+ * host pauses that long to get it expecting an opcode again.
+ */
+#define SERIAL_PAYLOAD_MASKED 0xFF
+
+#define SERIAL_BOOT_BAUDRATE 115200
+#define SERIAL_BAUD_TRIAL_MS 200
+#define SERIAL_BAUD_IDLE_MS 3000
+#define SERIAL_RESYNC_US 5000
+
+#define SERIAL_OPS(OP) \
+	OP(SCFG, 4) /* screen w, h; nothing to do anymore */ \
+	OP(MMOV, 4) /* relative move, HID logical units */ \
+	OP(MSET, 4) /* absolute position, HID logical units */ \
+	OP(MBDN, 4) /* button mask */ \
+	OP(MBUP, 4) \
+	OP(MWHL, 4) /* horizontal, vertical notches */ \
+	OP(KBDN, 4) /* HID usage id */ \
+	OP(KBUP, 4) \
+	OP(KRPT, 4) /* HID usage id, interval in ms */ \
+	OP(LEAV, 4) /* release everything */ \
+	OP(KREP, SERIAL_PAYLOAD_MASKED) /* modifiers, reserved, keys[6] */ \
+	OP(MREP, SERIAL_PAYLOAD_MASKED) /* buttons, u16 x, u16 y, wheel */ \
+	OP(PING, 4) /* u32 host timestamp, answered with SERIAL_UP_PONG */ \
+	OP(BAUD, 4) /* u32 baudrate to switch to after the ack, see arduino.ino */ \
+	OP(ECHO, 8) /* test pattern, sent back with SERIAL_UP_ECHO */ \
+	OP(RMOV, 4) /* relative move for the relative mouse, screen pixels */
+
+enum serial_op {
+#define SERIAL_OP_ENUM(name, len) SERIAL_OP_##name,
+	SERIAL_OPS(SERIAL_OP_ENUM)
+#undef SERIAL_OP_ENUM
+	SERIAL_OP_COUNT,
+};
+
+/* the keyboard report with the bitmask */
+#define SERIAL_MAX_PAYLOAD 9
+
+/* Firmware to host, single bytes unless noted otherwise */
+#define SERIAL_UP_ACK 0x01
+/** Followed by a u32 count of the bytes or messages lost so far */
+#define SERIAL_UP_OVERRUNS 0xFE
+/** Followed by u32s: the PING timestamp, then the firmware's micros() when
+ * the PING was received, when it was handled, and when the last HID report
+ * was sent */
+#define SERIAL_UP_PONG 0xFD
+/** Followed by the 8 bytes of an ECHO */
+#define SERIAL_UP_ECHO 0xFC
+#define SERIAL_UP_RESET 0xFF
+
+#endif /* SYNERGY_SERIAL_PROTO */
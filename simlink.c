@@ -0,0 +1,425 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "simlink.h"
+#include "serial_proto.h"
+#include "clock.h"
+#include "config.h"
+#include "common.h"
+#include "stats.h"
+
+#define SIMLINK_RING_SIZE 64
+/* an ack per message, and there's at most a few pongs among them */
+#define SIMLINK_UP_RING_SIZE 256
+
+static const uint8_t g_op_len[] = {
+#define SERIAL_OP_LEN(name, len) len,
+	SERIAL_OPS(SERIAL_OP_LEN)
+#undef SERIAL_OP_LEN
+};
+
+static uint64_t g_byte_ns;
+static uint64_t g_wire_free_ns;
+static uint64_t g_fw_free_ns;
+/* when the firmware last sent a HID report */
+static uint64_t g_fw_hid_ns;
+/* when it last sent one with relative movement (MMOV or RMOV) */
+static uint64_t g_fw_move_ns;
+
+/* messages received by the firmware but not handled yet */
+static struct {
+	uint64_t done_ns; /**< fully shifted in */
+	uint64_t write_ns; /**< written by the host */
+	uint8_t op;
+	uint16_t arg1;
+	uint16_t arg2;
+	uint8_t echo[8]; /**< the whole ECHO payload */
+} g_msgs[SIMLINK_RING_SIZE];
+static unsigned g_msgs_head, g_msgs_tail;
+
+/* the uplink bytes not read yet, with their arrival times */
+static struct {
+	uint64_t done_ns;
+	uint8_t byte;
+} g_up[SIMLINK_UP_RING_SIZE];
+static unsigned g_up_head, g_up_tail;
+static uint64_t g_up_free_ns;
+
+/* the firmware's pending HID reports, see arduino.ino */
+static struct {
+	bool mouse_dirty;
+	bool buttons_dirty;
+	int keys_dir; /**< 1 presses pending, -1 releases, 0 none */
+	bool mouse_moved; /**< the pending absolute report has an MMOV */
+	int32_t rel_dx, rel_dy; /**< for the relative mouse */
+	bool moved; /**< relative movement sent in this loop() pass */
+	unsigned nreports;
+	unsigned nhandled; /**< messages, since the last reset */
+} g_fw;
+
+void
+simlink_init(int baudrate)
+{
+	g_byte_ns = 10 * 1000000000ULL / baudrate; /* 8n1 */
+	g_wire_free_ns = 0;
+	g_fw_free_ns = 0;
+	g_fw_hid_ns = 0;
+	g_fw_move_ns = 0;
+	g_msgs_head = g_msgs_tail = 0;
+	memset(&g_fw, 0, sizeof(g_fw));
+	g_up_head = g_up_tail = 0;
+	g_up_free_ns = 0;
+}
+
+/* the firmware writes a byte at now_ns, after anything it wrote before */
+static void
+up_write(uint8_t byte, uint64_t now_ns)
+{
+	if (g_up_free_ns < now_ns) {
+		g_up_free_ns = now_ns;
+	}
+	g_up_free_ns += g_byte_ns;
+
+	if (g_up_head - g_up_tail == SIMLINK_UP_RING_SIZE) {
+		LOG(LOG_ERROR, "uplink overflow, the host isn't reading");
+		return;
+	}
+	g_up[g_up_head % SIMLINK_UP_RING_SIZE].done_ns = g_up_free_ns;
+	g_up[g_up_head % SIMLINK_UP_RING_SIZE].byte = byte;
+	g_up_head++;
+}
+
+static void
+up_write32(uint32_t val, uint64_t now_ns)
+{
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		up_write(val >> (i * 8), now_ns);
+	}
+}
+
+static void
+fw_send_mouse(void)
+{
+	if (g_fw.mouse_dirty) {
+		g_fw.nreports++;
+		g_fw.moved |= g_fw.mouse_moved;
+		g_fw.mouse_dirty = g_fw.buttons_dirty = g_fw.mouse_moved = false;
+	}
+}
+
+/* a report per 127 in either direction */
+static void
+fw_send_rel(void)
+{
+	int32_t dx = g_fw.rel_dx < 0 ? -g_fw.rel_dx : g_fw.rel_dx;
+	int32_t dy = g_fw.rel_dy < 0 ? -g_fw.rel_dy : g_fw.rel_dy;
+	int32_t d = dx > dy ? dx : dy;
+
+	if (d) {
+		g_fw.nreports += (d + 126) / 127;
+		g_fw.moved = true;
+		g_fw.rel_dx = g_fw.rel_dy = 0;
+	}
+}
+
+static void
+fw_send_keys(void)
+{
+	if (g_fw.keys_dir) {
+		g_fw.nreports++;
+		g_fw.keys_dir = 0;
+	}
+}
+
+static void
+fw_keys(int dir)
+{
+	if (g_fw.buttons_dirty) {
+		fw_send_mouse();
+	}
+	if (g_fw.keys_dir && g_fw.keys_dir != dir) {
+		fw_send_keys();
+	}
+	g_fw.keys_dir = dir;
+}
+
+/* count the reports just like the firmware would send them */
+static void
+fw_handle(uint8_t op, uint16_t arg1, uint16_t arg2)
+{
+	switch (op) {
+	case SERIAL_OP_MMOV:
+		g_fw.mouse_moved = true;
+		/* fallthrough */
+	case SERIAL_OP_MSET:
+		g_fw.mouse_dirty = true;
+		break;
+	case SERIAL_OP_RMOV:
+		if (g_fw.buttons_dirty) {
+			fw_send_mouse();
+		}
+		g_fw.rel_dx += (int16_t)arg1;
+		g_fw.rel_dy += (int16_t)arg2;
+		break;
+	case SERIAL_OP_MBDN:
+	case SERIAL_OP_MBUP:
+		fw_send_rel();
+		if (g_fw.keys_dir) {
+			fw_send_keys();
+		}
+		if (g_fw.buttons_dirty) {
+			fw_send_mouse();
+		}
+		g_fw.mouse_dirty = g_fw.buttons_dirty = true;
+		break;
+	case SERIAL_OP_MWHL:
+		if (arg2) {
+			g_fw.mouse_dirty = true;
+		}
+		if (arg1) {
+			/* shift + wheel, right away */
+			fw_send_keys();
+			fw_send_mouse();
+			g_fw.nreports += 3;
+		}
+		break;
+	case SERIAL_OP_KBDN:
+		fw_keys(1);
+		break;
+	case SERIAL_OP_KBUP:
+		fw_keys(-1);
+		break;
+	case SERIAL_OP_KREP:
+	case SERIAL_OP_MREP:
+		/* forwarded right away */
+		fw_send_rel();
+		fw_send_keys();
+		fw_send_mouse();
+		g_fw.nreports++;
+		break;
+	case SERIAL_OP_LEAV:
+		fw_send_keys();
+		fw_send_mouse();
+		g_fw.mouse_dirty = g_fw.buttons_dirty = true;
+		g_fw.keys_dir = -1;
+		break;
+	default:
+		break;
+	}
+}
+
+/* run all the loop() passes that start by now_ns; the later ones might
+ * still pick up more messages */
+static void
+fw_run(uint64_t now_ns)
+{
+	while (g_msgs_tail != g_msgs_head) {
+		uint64_t start_ns = g_msgs[g_msgs_tail % SIMLINK_RING_SIZE].done_ns;
+		unsigned first = g_msgs_tail, i;
+
+		if (start_ns < g_fw_free_ns) {
+			start_ns = g_fw_free_ns;
+		}
+		if (start_ns > now_ns) {
+			break;
+		}
+
+		g_fw.nreports = 0;
+		g_fw.moved = false;
+		while (g_msgs_tail != g_msgs_head &&
+				g_msgs[g_msgs_tail % SIMLINK_RING_SIZE].done_ns <= start_ns) {
+			unsigned idx = g_msgs_tail % SIMLINK_RING_SIZE;
+
+			/* the firmware's micros() is our clock here */
+			up_write(SERIAL_UP_ACK, start_ns);
+			if (g_msgs[idx].op == SERIAL_OP_PING) {
+				up_write(SERIAL_UP_PONG, start_ns);
+				up_write32(g_msgs[idx].arg1 | (uint32_t)g_msgs[idx].arg2 << 16, start_ns);
+				up_write32(g_msgs[idx].done_ns / 1000, start_ns);
+				up_write32(start_ns / 1000, start_ns);
+				up_write32(g_fw_hid_ns / 1000, start_ns);
+			} else if (g_msgs[idx].op == SERIAL_OP_ECHO) {
+				unsigned i;
+
+				up_write(SERIAL_UP_ECHO, start_ns);
+				for (i = 0; i < 8; i++) {
+					up_write(g_msgs[idx].echo[i], start_ns);
+				}
+			} else if (g_msgs[idx].op == SERIAL_OP_BAUD) {
+				/* both ways, once the ack is out; the link is perfect, so
+				 * the host always confirms it */
+				g_byte_ns = 10 * 1000000000ULL /
+					(g_msgs[idx].arg1 | (uint32_t)g_msgs[idx].arg2 << 16);
+			}
+			fw_handle(g_msgs[idx].op, g_msgs[idx].arg1, g_msgs[idx].arg2);
+			g_fw.nhandled++;
+			g_msgs_tail++;
+		}
+		fw_send_rel();
+		fw_send_keys();
+		fw_send_mouse();
+
+		g_fw_free_ns = start_ns + (CONFIG_SIMLINK_LOOP_COST_US +
+				g_fw.nreports * CONFIG_SIMLINK_HID_COST_US) * 1000;
+		if (g_fw.nreports) {
+			g_fw_hid_ns = g_fw_free_ns;
+		}
+		if (g_fw.moved) {
+			/* a longer gap is the movement stopping, not stuttering */
+			if (g_fw_move_ns && g_fw_free_ns - g_fw_move_ns < 100000000ULL) {
+				STATS_HIST_ADD(&g_stats_move_report_gap_us, (g_fw_free_ns - g_fw_move_ns) / 1000);
+			}
+			g_fw_move_ns = g_fw_free_ns;
+		}
+		for (i = first; g_fw.nreports && i != g_msgs_tail; i++) {
+			unsigned idx = i % SIMLINK_RING_SIZE;
+			uint64_t latency_us = (g_fw_free_ns - g_msgs[idx].write_ns) / 1000;
+
+			STATS_HIST_ADD(&g_stats_write_to_report_us, latency_us);
+			if (g_msgs[idx].op == SERIAL_OP_KBDN || g_msgs[idx].op == SERIAL_OP_KBUP ||
+					g_msgs[idx].op == SERIAL_OP_KREP) {
+				STATS_HIST_ADD(&g_stats_key_write_to_report_us, latency_us);
+			}
+		}
+	}
+}
+
+void
+simlink_write(const void *buf, size_t len)
+{
+	const uint8_t *bytes = buf;
+	uint64_t now_ns = clock_now_ns();
+	size_t off = 0;
+
+	fw_run(now_ns);
+	if (g_wire_free_ns < now_ns) {
+		g_wire_free_ns = now_ns;
+	}
+
+	while (off < len) {
+		uint8_t op = bytes[off];
+		unsigned msg_len;
+
+		if (op >= SERIAL_OP_COUNT) {
+			LOG(LOG_ERROR, "invalid opcode %u", op);
+			return;
+		}
+
+		if (g_op_len[op] == SERIAL_PAYLOAD_MASKED) {
+			msg_len = 2 + __builtin_popcount(bytes[off + 1]);
+		} else {
+			msg_len = 1 + g_op_len[op];
+			memcpy(&g_msgs[g_msgs_head % SIMLINK_RING_SIZE].arg1, &bytes[off + 1], 2);
+			memcpy(&g_msgs[g_msgs_head % SIMLINK_RING_SIZE].arg2, &bytes[off + 3], 2);
+			if (op == SERIAL_OP_ECHO) {
+				memcpy(g_msgs[g_msgs_head % SIMLINK_RING_SIZE].echo, &bytes[off + 1], 8);
+			}
+		}
+
+		g_wire_free_ns += msg_len * g_byte_ns;
+		g_msgs[g_msgs_head % SIMLINK_RING_SIZE].done_ns = g_wire_free_ns;
+		g_msgs[g_msgs_head % SIMLINK_RING_SIZE].write_ns = now_ns;
+		g_msgs[g_msgs_head % SIMLINK_RING_SIZE].op = op;
+		g_msgs_head++;
+		off += msg_len;
+	}
+}
+
+int
+simlink_outq(void)
+{
+	uint64_t now_ns = clock_now_ns();
+
+	if (g_wire_free_ns <= now_ns) {
+		return 0;
+	}
+	return (g_wire_free_ns - now_ns + g_byte_ns - 1) / g_byte_ns;
+}
+
+/* the next uplink byte's arrival, or at least the loop() pass before it */
+static uint64_t
+next_event_ns(void)
+{
+	uint64_t next_ns = UINT64_MAX;
+
+	if (g_up_tail != g_up_head) {
+		next_ns = g_up[g_up_tail % SIMLINK_UP_RING_SIZE].done_ns;
+	} else if (g_msgs_tail != g_msgs_head) {
+		next_ns = g_msgs[g_msgs_tail % SIMLINK_RING_SIZE].done_ns;
+		if (next_ns < g_fw_free_ns) {
+			next_ns = g_fw_free_ns;
+		}
+	}
+
+	return next_ns;
+}
+
+uint64_t
+simlink_next_us(void)
+{
+	uint64_t next_ns = next_event_ns();
+
+	/* round up, so that it really happened by then */
+	return next_ns == UINT64_MAX ? UINT64_MAX : (next_ns + 999) / 1000;
+}
+
+int
+simlink_read(uint8_t *buf, size_t len, int timeout_ms)
+{
+	uint64_t now_ns = clock_now_ns();
+	uint64_t deadline_ns = now_ns + timeout_ms * 1000000ULL;
+	size_t n = 0;
+
+	while (1) {
+		uint64_t next_ns;
+
+		fw_run(now_ns);
+		while (n < len && g_up_tail != g_up_head &&
+				g_up[g_up_tail % SIMLINK_UP_RING_SIZE].done_ns <= now_ns) {
+			buf[n++] = g_up[g_up_tail % SIMLINK_UP_RING_SIZE].byte;
+			g_up_tail++;
+		}
+		if (n > 0) {
+			return n;
+		}
+
+		next_ns = next_event_ns();
+		if (next_ns > deadline_ns) {
+			clock_sim_advance_to(deadline_ns / 1000);
+			return -ETIMEDOUT;
+		}
+
+		/* round up, so that it really happened by then */
+		clock_sim_advance_to((next_ns + 999) / 1000);
+		now_ns = clock_now_ns();
+	}
+}
+
+void
+simlink_reset(void)
+{
+	uint64_t now_ns = clock_now_ns();
+
+	/* what's already on its way up still gets there */
+	fw_run(now_ns);
+	g_msgs_tail = g_msgs_head;
+	memset(&g_fw, 0, sizeof(g_fw));
+	g_fw_free_ns = now_ns;
+	g_byte_ns = 10 * 1000000000ULL / SERIAL_BOOT_BAUDRATE;
+	up_write(SERIAL_UP_RESET, now_ns);
+}
+
+unsigned
+simlink_nhandled(void)
+{
+	fw_run(clock_now_ns());
+	return g_fw.nhandled;
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_SIMLINK
+#define SYNERGY_SERIAL_SIMLINK
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The UART and the firmware on the other end, modelled against the
+ * simulated clock (see clock.h). Much like emu/, but in-process and without
+ * any real time passing: each message takes its wire time at the given
+ * baudrate and is buffered by the firmware's UART interrupt. Each loop()
+ * pass handles all the buffered messages, acks them (and answers PINGs) and
+ * costs CONFIG_SIMLINK_LOOP_COST_US plus CONFIG_SIMLINK_HID_COST_US per HID
+ * report it sends, with the reports coalesced just like arduino.ino does. */
+
+void simlink_init(int baudrate);
+/** Put whole serial messages on the wire at the current time */
+void simlink_write(const void *buf, size_t len);
+/** Like poll() + read() of the acks and such; advances the clock up to the
+ * first byte or timeout_ms. Returns the number of bytes read or -ETIMEDOUT. */
+int simlink_read(uint8_t *buf, size_t len, int timeout_ms);
+/** Like TIOCOUTQ - the bytes written but not on the wire yet */
+int simlink_outq(void);
+/** When there might be something to read next, UINT64_MAX if not before
+ * more is written. Like the serial fd's poll() readiness. */
+uint64_t simlink_next_us(void);
+/** Reset the firmware now, like kill -USR1 on emu/: whatever it didn't
+ * handle yet is lost, and it announces itself at SERIAL_BOOT_BAUDRATE */
+void simlink_reset(void);
+/** Messages the firmware handled since it was last reset */
+unsigned simlink_nhandled(void);
+
+#endif /* SYNERGY_SERIAL_SIMLINK */
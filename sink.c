@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sink.h"
+#include "config.h"
+#include "stats.h"
+#include "trace.h"
+#include "tap.h"
+
+static bool
+is_key_down(struct sink *sink, uint16_t id)
+{
+	return sink->keys_down[id / 64] & (1ULL << (id % 64));
+}
+
+static int
+queue_event(struct sink *sink, struct sink_event ev)
+{
+	if (sink->batch_len == sizeof(sink->batch) / sizeof(sink->batch[0])) {
+		int rc = sink_submit(sink);
+
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	TAP_STAGE(&ev);
+	sink->batch[sink->batch_len++] = ev;
+	return 0;
+}
+
+int
+sink_move(struct sink *sink, int16_t dx, int16_t dy)
+{
+	return queue_event(sink, (struct sink_event){ .type = SINK_EV_MOVE, .dx = dx, .dy = dy });
+}
+
+int
+sink_set_pos(struct sink *sink, uint16_t x, uint16_t y)
+{
+	return queue_event(sink, (struct sink_event){ .type = SINK_EV_SET_POS, .x = x, .y = y });
+}
+
+int
+sink_button(struct sink *sink, uint8_t id, bool down)
+{
+	if (down) {
+		if ((sink->buttons_down & id) == id) {
+			return 0;
+		}
+		sink->buttons_down |= id;
+	} else {
+		sink->buttons_down &= ~id;
+	}
+
+	return queue_event(sink, (struct sink_event){ .type = SINK_EV_BUTTON, .id = id, .down = down });
+}
+
+int
+sink_wheel(struct sink *sink, int16_t dx, int16_t dy)
+{
+	return queue_event(sink, (struct sink_event){ .type = SINK_EV_WHEEL, .dx = dx, .dy = dy });
+}
+
+int
+sink_key(struct sink *sink, uint16_t id, bool down)
+{
+	if (down) {
+		if (is_key_down(sink, id)) {
+			return 0;
+		}
+		sink->keys_down[id / 64] |= 1ULL << (id % 64);
+		sink->nkeys_down++;
+	} else if (is_key_down(sink, id)) {
+		sink->keys_down[id / 64] &= ~(1ULL << (id % 64));
+		sink->nkeys_down--;
+	}
+
+	return queue_event(sink, (struct sink_event){ .type = SINK_EV_KEY, .id = id, .down = down });
+}
+
+int
+sink_key_repeat(struct sink *sink, uint16_t id)
+{
+	if (!is_key_down(sink, id) || !sink->ops->key_repeat) {
+		return 0;
+	}
+
+	return queue_event(sink, (struct sink_event){ .type = SINK_EV_KEY_REPEAT, .id = id });
+}
+
+int
+sink_release_all(struct sink *sink)
+{
+	unsigned i;
+	int rc;
+
+	for (i = 0; sink->nkeys_down > 0 && i < sizeof(sink->keys_down) / sizeof(sink->keys_down[0]); i++) {
+		while (sink->keys_down[i]) {
+			rc = sink_key(sink, i * 64 + __builtin_ctzll(sink->keys_down[i]), false);
+			if (rc < 0) {
+				return rc;
+			}
+		}
+	}
+
+	if (sink->buttons_down) {
+		rc = sink_button(sink, sink->buttons_down, false);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	rc = queue_event(sink, (struct sink_event){ .type = SINK_EV_RELEASE_ALL });
+	if (rc < 0) {
+		return rc;
+	}
+
+	return sink_submit(sink);
+}
+
+static int16_t
+add_sat16(int16_t a, int16_t b)
+{
+	int32_t sum = (int32_t)a + b;
+
+	return sum > INT16_MAX ? INT16_MAX : (sum < INT16_MIN ? INT16_MIN : sum);
+}
+
+/* Merge the events in place. All motion between two key or button events
+ * becomes a single event (or two, if there's a relative move after an
+ * absolute one), and so does the wheel. Neither is merged across those, as
+ * where the pointer is at a click, or what's held while it moves or scrolls
+ * (e.g. shift-click, ctrl-scroll), matters. Everything else is kept as is,
+ * in order. */
+static unsigned
+coalesce(struct sink_event *evs, unsigned n)
+{
+	int motion = -1, wheel = -1;
+	unsigned i, out = 0;
+
+	for (i = 0; i < n; i++) {
+		struct sink_event *ev = &evs[i];
+
+		switch (ev->type) {
+			case SINK_EV_SET_POS:
+				if (motion >= 0) {
+					/* supersedes any motion so far */
+					evs[motion] = *ev;
+					continue;
+				}
+				motion = out;
+				break;
+			case SINK_EV_MOVE:
+				if (motion >= 0 && evs[motion].type == SINK_EV_MOVE) {
+					evs[motion].dx = add_sat16(evs[motion].dx, ev->dx);
+					evs[motion].dy = add_sat16(evs[motion].dy, ev->dy);
+					continue;
+				}
+				motion = out;
+				break;
+			case SINK_EV_WHEEL:
+				if (wheel >= 0) {
+					evs[wheel].dx = add_sat16(evs[wheel].dx, ev->dx);
+					evs[wheel].dy = add_sat16(evs[wheel].dy, ev->dy);
+					continue;
+				}
+				wheel = out;
+				break;
+			default:
+				motion = -1;
+				wheel = -1;
+				break;
+		}
+
+		evs[out++] = *ev;
+	}
+
+	return out;
+}
+
+static int
+dispatch_event(struct sink *sink, struct sink_event *ev)
+{
+	const struct sink_ops *ops = sink->ops;
+
+	switch (ev->type) {
+		case SINK_EV_MOVE:
+			return ops->move(sink, ev->dx, ev->dy);
+		case SINK_EV_SET_POS:
+			return ops->set_pos(sink, ev->x, ev->y);
+		case SINK_EV_BUTTON:
+			return ops->button(sink, ev->id, ev->down);
+		case SINK_EV_WHEEL:
+			return ops->wheel(sink, ev->dx, ev->dy);
+		case SINK_EV_KEY:
+			return ops->key(sink, ev->id, ev->down);
+		case SINK_EV_KEY_REPEAT:
+			return ops->key_repeat(sink, ev->id);
+		case SINK_EV_RELEASE_ALL:
+			return ops->release_all(sink);
+		default:
+			return 0;
+	}
+}
+
+static int
+commit(struct sink *sink)
+{
+	return sink->ops->commit ? sink->ops->commit(sink) : 0;
+}
+
+int
+sink_submit(struct sink *sink)
+{
+	uint64_t nwrites = sink->nwrites;
+	unsigned i, n;
+	int rc = 0;
+
+	if (sink->batch_len == 0) {
+		return 0;
+	}
+
+	TRACE_BEGIN(sink_submit, sink->batch_len);
+	STATS_HIST_ADD(&g_stats_batch_events, sink->batch_len);
+	n = coalesce(sink->batch, sink->batch_len);
+	sink->batch_len = 0;
+
+	for (i = 0; i < n && rc >= 0; i++) {
+		rc = dispatch_event(sink, &sink->batch[i]);
+	}
+
+	if (rc >= 0) {
+		rc = commit(sink);
+	}
+	TAP_PUBLISH(sink->nmsgs);
+
+	STATS_HIST_ADD(&g_stats_batch_writes, sink->nwrites - nwrites);
+	TRACE_END(sink_submit, n);
+	return rc;
+}
+
+int
+sink_flush(struct sink *sink)
+{
+	int rc;
+
+	rc = sink_submit(sink);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = sink->ops->flush(sink);
+	if (rc < 0) {
+		return rc;
+	}
+
+	return commit(sink);
+}
+
+int8_t
+sink_take_wheel_notches(int32_t *delta)
+{
+	int32_t notches = *delta / CONFIG_WHEEL_DELTA_PER_NOTCH;
+
+	/* anything above that and the remainder of a partial notch carry over */
+	if (notches > 127) {
+		notches = 127;
+	} else if (notches < -127) {
+		notches = -127;
+	}
+
+	*delta -= notches * CONFIG_WHEEL_DELTA_PER_NOTCH;
+	return notches;
+}
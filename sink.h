@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_SINK
+#define SYNERGY_SERIAL_SINK
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/* Where the decoded input ends up. Coordinates are synergy screen pixels,
+ * button ids are HID button bits, key ids are HID keyboard usages (as in
+ * arduino_keylayout.h).
+ */
+struct sink;
+
+struct sink_ops {
+	int (*move)(struct sink *sink, int16_t dx, int16_t dy);
+	int (*set_pos)(struct sink *sink, uint16_t x, uint16_t y);
+	int (*button)(struct sink *sink, uint8_t id, bool down);
+	/** raw wheel deltas, CONFIG_WHEEL_DELTA_PER_NOTCH per notch */
+	int (*wheel)(struct sink *sink, int16_t dx, int16_t dy);
+	int (*key)(struct sink *sink, uint16_t id, bool down);
+	/** optional; called once for a held key that started repeating */
+	int (*key_repeat)(struct sink *sink, uint16_t id);
+	/** called after all held keys and buttons were released one by one */
+	int (*release_all)(struct sink *sink);
+	/** called on every mouse interval tick */
+	int (*flush)(struct sink *sink);
+	/** optional; called after each batch, to write out what was queued */
+	int (*commit)(struct sink *sink);
+};
+
+enum sink_event_type {
+	SINK_EV_MOVE,
+	SINK_EV_SET_POS,
+	SINK_EV_BUTTON,
+	SINK_EV_WHEEL,
+	SINK_EV_KEY,
+	SINK_EV_KEY_REPEAT,
+	SINK_EV_RELEASE_ALL,
+};
+
+struct sink_event {
+	uint8_t type;
+	uint8_t down;
+	uint16_t id;
+	union {
+		struct {
+			int16_t dx, dy;
+		};
+		struct {
+			uint16_t x, y;
+		};
+	};
+};
+
+/* An instance of a sink. The input state is kept here too, so there's
+ * nothing global in between: any number of them can be driven at once,
+ * each from its own connection. Zero-initialize, then set name and ops. */
+struct sink {
+	const char *name;
+	const struct sink_ops *ops;
+	uint64_t nwrites; /**< write()s done so far, for the stats */
+	uint64_t nmsgs; /**< messages or reports queued so far, for the tap */
+
+	unsigned nkeys_down;
+	uint8_t buttons_down;
+	unsigned batch_len;
+	/** events since the last submit, usually everything from a single recv() */
+	struct sink_event batch[CONFIG_SINK_BATCH_SIZE];
+	uint64_t keys_down[65536 / 64];
+};
+
+/** The one picked by main.c */
+extern struct sink *g_sink;
+
+/* The functions below track what's held down, so that the sinks never
+ * get redundant presses, and queue the rest as events. Those are only
+ * passed to the sink's ops by sink_submit(), coalesced where possible. */
+int sink_move(struct sink *sink, int16_t dx, int16_t dy);
+int sink_set_pos(struct sink *sink, uint16_t x, uint16_t y);
+int sink_button(struct sink *sink, uint8_t id, bool down);
+int sink_wheel(struct sink *sink, int16_t dx, int16_t dy);
+int sink_key(struct sink *sink, uint16_t id, bool down);
+int sink_key_repeat(struct sink *sink, uint16_t id);
+/** Release only what's actually held down; submits right away */
+int sink_release_all(struct sink *sink);
+/** Coalesce all queued events and pass them to the sink's ops */
+int sink_submit(struct sink *sink);
+/** Submit, then let the sink send out the coalesced mouse state */
+int sink_flush(struct sink *sink);
+
+/** For the sinks: take the whole wheel notches out of the raw deltas
+ * accumulated in *delta, at most 127 at once, as a HID report fits */
+int8_t sink_take_wheel_notches(int32_t *delta);
+
+#endif /* SYNERGY_SERIAL_SINK */
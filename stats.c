@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "stats.h"
+#include "common.h"
+
+bool g_stats_enabled = false;
+uint64_t g_stats_last_recv_us;
+
+struct stats_hist g_stats_tick_lateness_us = { .name = "timer tick lateness (us)" };
+struct stats_hist g_stats_recv_to_write_us = { .name = "recv to serial write (us)" };
+struct stats_hist g_stats_batch_events = { .name = "input events per batch" };
+struct stats_hist g_stats_batch_writes = { .name = "output writes per batch" };
+/* only known with the simulated link */
+struct stats_hist g_stats_write_to_report_us = { .name = "serial write to hid report (us)" };
+struct stats_hist g_stats_key_write_to_report_us = { .name = "serial key write to hid report (us)" };
+struct stats_hist g_stats_ping_rtt_us = { .name = "serial ping rtt (us)" };
+struct stats_hist g_stats_fw_queue_us = { .name = "firmware queueing delay (us)" };
+/* the rtt without the above: wire time plus any buffering in the adapter */
+struct stats_hist g_stats_link_delay_us = { .name = "serial link delay (us)" };
+/* from the first relative move merged into a message */
+struct stats_hist g_stats_move_recv_to_write_us = { .name = "relative move recv to serial write (us)" };
+/* between HID reports with relative movement, only while it keeps coming;
+ * only known with the simulated link */
+struct stats_hist g_stats_move_report_gap_us = { .name = "relative move report interval (us)" };
+/* sampled whenever there's mouse movement that could be held back */
+struct stats_hist g_stats_txq_depth = { .name = "serial tx queue depth (bytes)" };
+
+static struct stats_hist *g_stats_hists[] = {
+	&g_stats_tick_lateness_us,
+	&g_stats_recv_to_write_us,
+	&g_stats_batch_events,
+	&g_stats_batch_writes,
+	&g_stats_write_to_report_us,
+	&g_stats_key_write_to_report_us,
+	&g_stats_move_recv_to_write_us,
+	&g_stats_move_report_gap_us,
+	&g_stats_ping_rtt_us,
+	&g_stats_fw_queue_us,
+	&g_stats_link_delay_us,
+	&g_stats_txq_depth,
+};
+
+void
+stats_hist_add(struct stats_hist *hist, uint64_t val)
+{
+	unsigned bucket = val ? 64 - __builtin_clzll(val) : 0;
+
+	if (bucket >= sizeof(hist->buckets) / sizeof(hist->buckets[0])) {
+		bucket = sizeof(hist->buckets) / sizeof(hist->buckets[0]) - 1;
+	}
+
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum += val;
+	if (val > hist->max) {
+		hist->max = val;
+	}
+}
+
+/* upper bound of the bucket that holds the given percentile */
+static uint64_t
+stats_hist_percentile(struct stats_hist *hist, unsigned pct)
+{
+	uint64_t threshold = (hist->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	unsigned i;
+
+	for (i = 0; i < sizeof(hist->buckets) / sizeof(hist->buckets[0]); i++) {
+		seen += hist->buckets[i];
+		if (seen >= threshold) {
+			uint64_t bound = i ? (1ULL << i) - 1 : 0;
+			return bound < hist->max ? bound : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+static void
+stats_hist_dump(struct stats_hist *hist)
+{
+	unsigned i;
+
+	if (hist->count == 0) {
+		LOG(LOG_INFO, "%s: no samples", hist->name);
+		return;
+	}
+
+	LOG(LOG_INFO, "%s: n=%"PRIu64" avg=%"PRIu64" p50<=%"PRIu64" p99<=%"PRIu64" max=%"PRIu64,
+			hist->name, hist->count, hist->sum / hist->count,
+			stats_hist_percentile(hist, 50), stats_hist_percentile(hist, 99), hist->max);
+
+	for (i = 0; i < sizeof(hist->buckets) / sizeof(hist->buckets[0]); i++) {
+		if (hist->buckets[i] == 0) {
+			continue;
+		}
+
+		LOG(LOG_INFO, "  [%"PRIu64", %"PRIu64"]: %"PRIu64,
+				i ? 1ULL << (i - 1) : 0, i ? (1ULL << i) - 1 : 0, hist->buckets[i]);
+	}
+}
+
+void
+stats_dump(void)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(g_stats_hists) / sizeof(g_stats_hists[0]); i++) {
+		stats_hist_dump(g_stats_hists[i]);
+	}
+}
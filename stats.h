@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_STATS
+#define SYNERGY_SERIAL_STATS
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct stats_hist {
+	const char *name;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[32]; /**< [i] counts values in [2^(i-1), 2^i) */
+};
+
+extern bool g_stats_enabled;
+
+extern struct stats_hist g_stats_tick_lateness_us;
+extern struct stats_hist g_stats_recv_to_write_us;
+extern struct stats_hist g_stats_batch_events;
+extern struct stats_hist g_stats_batch_writes;
+extern struct stats_hist g_stats_write_to_report_us;
+extern struct stats_hist g_stats_ping_rtt_us;
+extern struct stats_hist g_stats_fw_queue_us;
+extern struct stats_hist g_stats_link_delay_us;
+extern struct stats_hist g_stats_txq_depth;
+extern struct stats_hist g_stats_key_write_to_report_us;
+extern struct stats_hist g_stats_move_recv_to_write_us;
+extern struct stats_hist g_stats_move_report_gap_us;
+
+/** Timestamp of the last recv() from the server, 0 once it's accounted */
+extern uint64_t g_stats_last_recv_us;
+
+void stats_hist_add(struct stats_hist *hist, uint64_t val);
+/** Print all histograms */
+void stats_dump(void);
+
+#define STATS_HIST_ADD(hist, val) \
+({ \
+	if (__builtin_expect(g_stats_enabled, 0)) { \
+		stats_hist_add((hist), (val)); \
+	} \
+})
+
+#endif /* SYNERGY_SERIAL_STATS */
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_MSGS
+#define SYNERGY_SERIAL_MSGS
+
+#include <stdint.h>
+
+/* Fixed-size synergy messages, each as MSG(tag, name). The fields of each
+ * are listed in SYNERGY_MSG_FIELDS_<name> as F(type, field), in wire order.
+ * synergy_proto.c generates a struct synergy_msg_<name> for each of them,
+ * and a decoder that checks the length once, loads all the big endian fields
+ * and then calls proto_handle_<name>(conn, &msg).
+ *
+ * Variable-length messages (DSOP, DCLP) are parsed by hand instead.
+ */
+#define SYNERGY_FIXED_MSGS(MSG) \
+	MSG("QINF", query_info) \
+	MSG("CIAK", info_ack) \
+	MSG("CROP", reset_options) \
+	MSG("CALV", keepalive) \
+	MSG("CINN", screen_enter) \
+	MSG("COUT", screen_leave) \
+	MSG("DMMV", mouse_move) \
+	MSG("DMRM", rel_mouse_move) \
+	MSG("DMDN", mouse_down) \
+	MSG("DMUP", mouse_up) \
+	MSG("DMWM", mouse_wheel) \
+	MSG("DKDN", key_down) \
+	MSG("DKRP", key_repeat) \
+	MSG("DKUP", key_up)
+
+#define SYNERGY_MSG_FIELDS_query_info(F)
+#define SYNERGY_MSG_FIELDS_info_ack(F)
+#define SYNERGY_MSG_FIELDS_reset_options(F)
+#define SYNERGY_MSG_FIELDS_keepalive(F)
+#define SYNERGY_MSG_FIELDS_screen_enter(F) \
+	F(uint16_t, x) \
+	F(uint16_t, y) \
+	F(uint32_t, seq_no) \
+	F(uint16_t, key_mod_mask)
+#define SYNERGY_MSG_FIELDS_screen_leave(F)
+#define SYNERGY_MSG_FIELDS_mouse_move(F) \
+	F(uint16_t, x) \
+	F(uint16_t, y)
+#define SYNERGY_MSG_FIELDS_rel_mouse_move(F) \
+	F(int16_t, dx) \
+	F(int16_t, dy)
+#define SYNERGY_MSG_FIELDS_mouse_down(F) \
+	F(uint8_t, id)
+#define SYNERGY_MSG_FIELDS_mouse_up(F) \
+	F(uint8_t, id)
+#define SYNERGY_MSG_FIELDS_mouse_wheel(F) \
+	F(int16_t, dx) \
+	F(int16_t, dy)
+#define SYNERGY_MSG_FIELDS_key_down(F) \
+	F(uint16_t, id) \
+	F(uint16_t, mods) \
+	F(uint16_t, phys_id)
+#define SYNERGY_MSG_FIELDS_key_repeat(F) \
+	F(uint16_t, id) \
+	F(uint16_t, mods) \
+	F(uint16_t, count) \
+	F(uint16_t, phys_id)
+#define SYNERGY_MSG_FIELDS_key_up(F) \
+	F(uint16_t, id) \
+	F(uint16_t, mods) \
+	F(uint16_t, phys_id)
+
+#endif /* SYNERGY_SERIAL_MSGS */
@@ -15,7 +15,9 @@
 #include "synergy_proto.h"
 #include "common.h"
 #include "config.h"
-#include "serial.h"
+#include "sink.h"
+#include "trace.h"
+#include "synergy_msgs.h"
 #include "arduino_keylayout.h"
 
 enum {
@@ -30,6 +32,48 @@ enum {
 #define STR2TAG(str) \
 	((uint32_t)(((str)[0] << 24) | ((str)[1] << 16) | ((str)[2] << 8) | ((str)[3])))
 
+#define MSG_FIELD_DECL(type, field) type field;
+#define MSG_STRUCT_DECL(tag, name) \
+	struct synergy_msg_##name { \
+		SYNERGY_MSG_FIELDS_##name(MSG_FIELD_DECL) \
+	};
+SYNERGY_FIXED_MSGS(MSG_STRUCT_DECL)
+
+#define MSG_FIELD_SIZE(type, field) + sizeof(type)
+/** Length of a fixed-size message on the wire, without the tag */
+#define MSG_LEN(name) (0 SYNERGY_MSG_FIELDS_##name(MSG_FIELD_SIZE))
+
+/* the fields aren't aligned in the packet buffer */
+static inline uint8_t
+load_uint8_t(const uint8_t *p)
+{
+	return p[0];
+}
+
+static inline uint16_t
+load_uint16_t(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohs(v);
+}
+
+static inline int16_t
+load_int16_t(const uint8_t *p)
+{
+	return (int16_t)load_uint16_t(p);
+}
+
+static inline uint32_t
+load_uint32_t(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
 static uint8_t __attribute__((used))
 read_uint8(struct synergy_proto_conn *conn)
 {
@@ -40,7 +84,7 @@ read_uint8(struct synergy_proto_conn *conn)
 
 	conn->recv_buf += 1;
 	conn->recv_len -= 1;
-	return *(uint8_t *)(conn->recv_buf - 1);
+	return *(const uint8_t *)(conn->recv_buf - 1);
 }
 
 static int8_t __attribute__((used))
@@ -49,15 +93,34 @@ read_int8(struct synergy_proto_conn *conn)
 	return (int8_t)read_uint8(conn);
 }
 
-static void __attribute__((used))
-write_uint8(struct synergy_proto_conn *conn, uint8_t val)
+static void *
+reserve_resp(struct synergy_proto_conn *conn, unsigned nbytes)
 {
 	void *buf;
 
-	assert(conn->resp_len + 1 < sizeof(conn->resp_buf));
+	if (conn->resp_len + nbytes > sizeof(conn->resp_buf) && conn->resp_start > 0) {
+		/* make room by sending out the responses queued so far */
+		synergy_proto_flush(conn);
+	}
+
+	if (conn->resp_len + nbytes > sizeof(conn->resp_buf)) {
+		conn->resp_error = -ENOBUFS;
+		return NULL;
+	}
+
 	buf = conn->resp_buf + conn->resp_len;
-	*(uint8_t *)buf = val;
-	conn->resp_len += 1;
+	conn->resp_len += nbytes;
+	return buf;
+}
+
+static void __attribute__((used))
+write_uint8(struct synergy_proto_conn *conn, uint8_t val)
+{
+	void *buf = reserve_resp(conn, 1);
+
+	if (buf) {
+		*(uint8_t *)buf = val;
+	}
 }
 
 static void __attribute__((used))
@@ -77,7 +140,7 @@ read_uint16(struct synergy_proto_conn *conn)
 
 	conn->recv_buf += 2;
 	conn->recv_len -= 2;
-	return ntohs(*(uint16_t *)(conn->recv_buf - 2));
+	return ntohs(*(const uint16_t *)(conn->recv_buf - 2));
 }
 
 static int16_t __attribute__((used))
@@ -89,12 +152,11 @@ read_int16(struct synergy_proto_conn *conn)
 static void __attribute__((used))
 write_uint16(struct synergy_proto_conn *conn, uint16_t val)
 {
-	void *buf;
+	void *buf = reserve_resp(conn, 2);
 
-	assert(conn->resp_len + 2 < sizeof(conn->resp_buf));
-	buf = conn->resp_buf + conn->resp_len;
-	*(uint16_t *)buf = htons(val);
-	conn->resp_len += 2;
+	if (buf) {
+		*(uint16_t *)buf = htons(val);
+	}
 }
 
 static void __attribute__((used))
@@ -113,7 +175,7 @@ read_uint32(struct synergy_proto_conn *conn)
 
 	conn->recv_buf += 4;
 	conn->recv_len -= 4;
-	return ntohl(*(uint32_t *)(conn->recv_buf - 4));
+	return ntohl(*(const uint32_t *)(conn->recv_buf - 4));
 }
 
 static int32_t __attribute__((used))
@@ -125,12 +187,11 @@ read_int32(struct synergy_proto_conn *conn)
 static void __attribute__((used))
 write_uint32(struct synergy_proto_conn *conn, uint32_t val)
 {
-	void *buf;
+	void *buf = reserve_resp(conn, 4);
 
-	assert(conn->resp_len + 4 < sizeof(conn->resp_buf));
-	buf = conn->resp_buf + conn->resp_len;
-	*(uint32_t *)buf = htonl(val);
-	conn->resp_len += 4;
+	if (buf) {
+		*(uint32_t *)buf = htonl(val);
+	}
 }
 
 static void __attribute__((used))
@@ -142,27 +203,25 @@ write_int32(struct synergy_proto_conn *conn, int32_t val)
 static void __attribute__((used))
 write_raw_string(struct synergy_proto_conn *conn, const char *str)
 {
-	void *buf;
 	uint32_t len = strlen(str);
+	void *buf = reserve_resp(conn, len);
 
-	assert(conn->resp_len + len < sizeof(conn->resp_buf));
-	buf = conn->resp_buf + conn->resp_len;
-	memcpy(buf, str, len);
-	conn->resp_len += len;
+	if (buf) {
+		memcpy(buf, str, len);
+	}
 }
 
 static void __attribute__((used))
 write_string(struct synergy_proto_conn *conn, const char *str)
 {
-	void *buf;
 	uint32_t len = strlen(str);
+	void *buf;
 
-	assert(conn->resp_len + len < sizeof(conn->resp_buf));
 	write_uint32(conn, len);
-
-	buf = conn->resp_buf + conn->resp_len;
-	memcpy(buf, str, len);
-	conn->resp_len += len;
+	buf = reserve_resp(conn, len);
+	if (buf) {
+		memcpy(buf, str, len);
+	}
 }
 
 static void __attribute__((used))
@@ -180,22 +239,53 @@ read_nbytes(struct synergy_proto_conn *conn, unsigned nbytes)
 static void __attribute__((used))
 clear_resp(struct synergy_proto_conn *conn)
 {
-	conn->resp_len = 4;
+	conn->resp_len = conn->resp_start + 4;
+	conn->resp_error = 0;
 }
 
+/* finish the current response and queue it. It will be sent together with
+ * any other responses in synergy_proto_flush() */
 static void __attribute__((used))
-flush_resp(struct synergy_proto_conn *conn)
+end_resp(struct synergy_proto_conn *conn)
 {
-	int rc;
+	if (conn->resp_error) {
+		LOG(LOG_ERROR, "dropping response: %d", conn->resp_error);
+		clear_resp(conn);
+		return;
+	}
 
-	*(uint32_t *)conn->resp_buf = htonl(conn->resp_len - 4);
+	*(uint32_t *)(conn->resp_buf + conn->resp_start) =
+		htonl(conn->resp_len - conn->resp_start - 4);
+	conn->resp_start = conn->resp_len;
+	conn->resp_len += 4;
+}
 
-	rc = send(conn->fd, conn->resp_buf, conn->resp_len, 0);
-	if (rc < 0) {
-		perror("send");
-		return;
+int
+synergy_proto_flush(struct synergy_proto_conn *conn)
+{
+	unsigned off = 0;
+	int rc = 0;
+
+	while (off < conn->resp_start) {
+		rc = conn->send(conn, conn->resp_buf + off, conn->resp_start - off);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			rc = -errno;
+			LOG(LOG_ERROR, "send: %s", strerror(errno));
+			break;
+		}
+		off += rc;
+		rc = 0;
 	}
-	conn->resp_len = 4;
+
+	/* move the response that's still being written (if any) to the front */
+	memmove(conn->resp_buf, conn->resp_buf + conn->resp_start,
+			conn->resp_len - conn->resp_start);
+	conn->resp_len -= conn->resp_start;
+	conn->resp_start = 0;
+	return rc;
 }
 
 #define EXIT_ON_RECV_ERROR(conn) \
@@ -221,6 +311,7 @@ flush_resp(struct synergy_proto_conn *conn)
 static void
 init_synergy_proto_conn(struct synergy_proto_conn *conn)
 {
+	conn->resp_start = 0;
 	conn->resp_len = 4;
 }
 
@@ -255,20 +346,14 @@ synergy_proto_handle_greeting(struct synergy_proto_conn *conn)
 	write_uint16(conn, majorver);
 	write_uint16(conn, minorver);
 	write_string(conn, CONFIG_HOSTNAME);
-	flush_resp(conn);
+	end_resp(conn);
 
-	return 0;
+	return synergy_proto_flush(conn);
 }
 
 static int
-proto_handle_qinf(struct synergy_proto_conn *conn)
+proto_handle_query_info(struct synergy_proto_conn *conn, const struct synergy_msg_query_info *msg)
 {
-	if (conn->recv_len != 0) {
-		LOG(LOG_ERROR, "invalid pkt len (got %d bytes, expected %d)",
-				conn->recv_len, 0);
-		return 1;
-	}
-
 	uint16_t x = CONFIG_SCREENX, y = CONFIG_SCREENY;
 	uint16_t w = CONFIG_SCREENW, h = CONFIG_SCREENH;
 	uint16_t warp_size = 0;
@@ -281,20 +366,20 @@ proto_handle_qinf(struct synergy_proto_conn *conn)
 	write_uint16(conn, warp_size);
 	write_uint16(conn, mpos_x);
 	write_uint16(conn, mpos_y);
-	flush_resp(conn);
+	end_resp(conn);
 
 	return 0;
 }
 
 static int
-proto_handle_dummy(struct synergy_proto_conn *conn, int exp_len)
+proto_handle_info_ack(struct synergy_proto_conn *conn, const struct synergy_msg_info_ack *msg)
 {
-	if (conn->recv_len != exp_len) {
-		LOG(LOG_ERROR, "invalid pkt len (got %d bytes, expected %d)",
-				conn->recv_len, exp_len);
-		return 1;
-	}
+	return 0;
+}
 
+static int
+proto_handle_reset_options(struct synergy_proto_conn *conn, const struct synergy_msg_reset_options *msg)
+{
 	return 0;
 }
 
@@ -320,7 +405,7 @@ proto_handle_set_options(struct synergy_proto_conn *conn)
 	}
 
 	while (num_opts > 0) {
-		char *tag_str = conn->recv_buf;
+		const char *tag_str = conn->recv_buf;
 		uint32_t tag = read_uint32(conn);
 		(void)tag;
 		uint32_t val = read_uint32(conn);
@@ -333,38 +418,31 @@ proto_handle_set_options(struct synergy_proto_conn *conn)
 }
 
 static int
-proto_handle_keepalive(struct synergy_proto_conn *conn)
+proto_handle_keepalive(struct synergy_proto_conn *conn, const struct synergy_msg_keepalive *msg)
 {
-	if (conn->recv_len != 0) {
-		LOG(LOG_ERROR, "invalid pkt len (got %d bytes, expected %d)",
-				conn->recv_len, 0);
-		return 1;
-	}
-
 	write_raw_string(conn, "CALV");
-	flush_resp(conn);
+	end_resp(conn);
 
 	return 0;
 }
 
-static bool g_skip_next_mouse_move = false;
-
 static int
-proto_handle_screen_enter(struct synergy_proto_conn *conn)
+proto_handle_screen_enter(struct synergy_proto_conn *conn, const struct synergy_msg_screen_enter *msg)
 {
-	uint16_t enter_x = read_uint16(conn);
-	uint16_t enter_y = read_uint16(conn);
-	uint32_t seq_no = read_uint32(conn);
-	uint16_t key_mod_mask = read_uint16(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
-
 	LOG(LOG_INFO, "screen enter; x=%u, y=%u, seq_no=%u, key_mask=%u",
-			enter_x, enter_y, seq_no, key_mod_mask);
+			msg->x, msg->y, msg->seq_no, msg->key_mod_mask);
 
 
-	g_skip_next_mouse_move = true;
-	serial_ard_set_mouse_pos(enter_x, enter_y);
+	conn->skip_next_mouse_move = true;
+	sink_set_pos(conn->sink, msg->x, msg->y);
+
+	return 0;
+}
 
+static int
+proto_handle_screen_leave(struct synergy_proto_conn *conn, const struct synergy_msg_screen_leave *msg)
+{
+	sink_release_all(conn->sink);
 	return 0;
 }
 
@@ -388,40 +466,31 @@ proto_handle_clipboard_sync(struct synergy_proto_conn *conn)
 }
 
 static int
-proto_handle_mouse_move(struct synergy_proto_conn *conn)
+proto_handle_mouse_move(struct synergy_proto_conn *conn, const struct synergy_msg_mouse_move *msg)
 {
-	uint16_t abs_x = read_uint16(conn);
-	uint16_t abs_y = read_uint16(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
-
-	if (g_skip_next_mouse_move) {
-		g_skip_next_mouse_move = false;
+	if (conn->skip_next_mouse_move) {
+		conn->skip_next_mouse_move = false;
 		return 0;
 	}
 
-	int16_t x_delta, y_delta;
-	x_delta = abs_x - conn->mouse_x;
-	y_delta = abs_y - conn->mouse_y;
+	//LOG(LOG_INFO, "mouse move (%u,%u)", msg->x, msg->y);
+	sink_set_pos(conn->sink, msg->x, msg->y);
 
-	//LOG(LOG_INFO, "mouse move (delta %d,%d)", x_delta, y_delta);
-	serial_ard_set_mouse_pos(abs_x, abs_y);
-
-	conn->mouse_x = abs_x;
-	conn->mouse_y = abs_y;
+	conn->mouse_x = msg->x;
+	conn->mouse_y = msg->y;
 
 	return 0;
 }
 
 static int
-proto_handle_rel_mouse_move(struct synergy_proto_conn *conn)
+proto_handle_rel_mouse_move(struct synergy_proto_conn *conn, const struct synergy_msg_rel_mouse_move *msg)
 {
-	int16_t x_delta = read_int16(conn);
-	int16_t y_delta = read_int16(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
+	int16_t x_delta = msg->dx;
+	int16_t y_delta = msg->dy;
 
 	//LOG(LOG_INFO, "rel mouse move (%d,%d)", x_delta, y_delta);
 
-	serial_ard_mouse_move(x_delta, y_delta);
+	sink_move(conn->sink, x_delta, y_delta);
 
 	if (x_delta < conn->mouse_x) {
 		x_delta = conn->mouse_x;
@@ -467,47 +536,34 @@ synergy_mouse_btn_to_arduino(uint8_t id)
 }
 
 static int
-proto_handle_mouse_down(struct synergy_proto_conn *conn)
+proto_handle_mouse_down(struct synergy_proto_conn *conn, const struct synergy_msg_mouse_down *msg)
 {
-	uint8_t id = read_uint8(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
-
-	LOG(LOG_DEBUG_1, "mouse down (%d)", id);
+	LOG(LOG_DEBUG_1, "mouse down (%d)", msg->id);
 
-	id = synergy_mouse_btn_to_arduino(id);
-	serial_ard_mouse_down(id);
+	sink_button(conn->sink, synergy_mouse_btn_to_arduino(msg->id), true);
 	return 0;
 }
 
 static int
-proto_handle_mouse_up(struct synergy_proto_conn *conn)
+proto_handle_mouse_up(struct synergy_proto_conn *conn, const struct synergy_msg_mouse_up *msg)
 {
-	uint8_t id = read_uint8(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
-
-	LOG(LOG_DEBUG_1, "mouse up (%d)", id);
+	LOG(LOG_DEBUG_1, "mouse up (%d)", msg->id);
 
-	id = synergy_mouse_btn_to_arduino(id);
-	serial_ard_mouse_up(id);
+	sink_button(conn->sink, synergy_mouse_btn_to_arduino(msg->id), false);
 	return 0;
 }
 
-#define SIGNUM(a) ((a) < 0 ? -1 : ((a) > 0 ? 1 : 0))
 static int
-proto_handle_mouse_wheel(struct synergy_proto_conn *conn)
+proto_handle_mouse_wheel(struct synergy_proto_conn *conn, const struct synergy_msg_mouse_wheel *msg)
 {
-	int16_t x_delta = read_int16(conn);
-	int16_t y_delta = read_int16(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
+	LOG(LOG_DEBUG_1, "mouse wheel (%d,%d)", msg->dx, msg->dy);
 
-	LOG(LOG_DEBUG_1, "mouse wheel (%d,%d)", x_delta, y_delta);
-
-	serial_ard_mouse_wheel(SIGNUM(x_delta), SIGNUM(y_delta));
+	sink_wheel(conn->sink, msg->dx, msg->dy);
 	return 0;
 }
 
 /* 0xEFXX */
-static uint8_t g_keycodes[] = {
+static const uint8_t g_keycodes[] = {
 	[0x08] = KEY_BACKSPACE,
 	[0x09] = KEY_TAB,
 	[0x0A] = KEY_ENTER,
@@ -617,7 +673,7 @@ static uint8_t g_keycodes[] = {
 };
 
 /* 0xE0XX */
-static uint16_t g_special_keymap[] = {
+static const uint16_t g_special_keymap[] = {
 	[0x5F] = CONSUMER_SLEEP,
 	[0xA6] = CONSUMER_BROWSER_BACK,
 	[0xA7] = CONSUMER_BROWSER_FORWARD,
@@ -639,7 +695,7 @@ static uint16_t g_special_keymap[] = {
 	[0xB9] = CONSUMER_BRIGHTNESS_UP,
 };
 
-static uint8_t g_char_keymap[] = {
+static const uint8_t g_char_keymap[] = {
 	['a'] = KEY_A,
 	['A'] = KEY_A,
 	['b'] = KEY_B,
@@ -770,32 +826,84 @@ synergy_key_to_arduino(uint16_t s_id, uint16_t char_id)
 }
 
 static int
-proto_handle_key_down(struct synergy_proto_conn *conn)
+proto_handle_key_down(struct synergy_proto_conn *conn, const struct synergy_msg_key_down *msg)
 {
-	uint16_t id = read_uint16(conn);
-	uint16_t mods = read_uint16(conn);
-	uint16_t phys_id = read_uint16(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
+	uint16_t ard_id = synergy_key_to_arduino(msg->phys_id, msg->id);
+	LOG(LOG_DEBUG_1, "key down (id=0x%x, phys_id=0x%x, mods=0x%.4x)",
+			msg->id, msg->phys_id, msg->mods);
 
-	uint16_t ard_id = synergy_key_to_arduino(phys_id, id);
-	LOG(LOG_DEBUG_1, "key down (id=0x%x, phys_id=0x%x, mods=0x%.4x)", id, phys_id, mods);
+	sink_key(conn->sink, ard_id, true);
+	return 0;
+}
+
+static int
+proto_handle_key_up(struct synergy_proto_conn *conn, const struct synergy_msg_key_up *msg)
+{
+	uint16_t ard_id = synergy_key_to_arduino(msg->phys_id, msg->id);
+	LOG(LOG_DEBUG_1, "key up (id=0x%x, phys_id=0x%x, mods=0x%.4x)",
+			msg->id, msg->phys_id, msg->mods);
 
-	serial_ard_key_down(ard_id);
+	sink_key(conn->sink, ard_id, false);
 	return 0;
 }
 
 static int
-proto_handle_key_up(struct synergy_proto_conn *conn)
+proto_handle_key_repeat(struct synergy_proto_conn *conn, const struct synergy_msg_key_repeat *msg)
 {
-	uint16_t id = read_uint16(conn);
-	uint16_t mods = read_uint16(conn);
-	uint16_t phys_id = read_uint16(conn);
-	EXIT_ON_INVALID_RECV_PKT(conn);
+	uint16_t ard_id = synergy_key_to_arduino(msg->phys_id, msg->id);
+	LOG(LOG_DEBUG_1, "key repeat (id=0x%x, phys_id=0x%x, mods=0x%.4x, count=%u)",
+			msg->id, msg->phys_id, msg->mods, msg->count);
+
+	sink_key_repeat(conn->sink, ard_id);
+	return 0;
+}
+
+#define MSG_FIELD_LOAD(type, field) \
+	msg.field = load_##type(p); \
+	p += sizeof(type);
+
+/* one bounds check, then the fields are loaded straight into the struct */
+#define MSG_DECODER(tag, name) \
+static int \
+decode_##name(struct synergy_proto_conn *conn) \
+{ \
+	struct synergy_msg_##name msg; \
+	const uint8_t *p = (const uint8_t *)conn->recv_buf; \
+\
+	if (conn->recv_len != MSG_LEN(name)) { \
+		LOG(LOG_ERROR, "invalid %s pkt len (got %d bytes, expected %zu)", \
+				(tag), conn->recv_len, MSG_LEN(name)); \
+		clear_resp(conn); \
+		return -1; \
+	} \
+\
+	SYNERGY_MSG_FIELDS_##name(MSG_FIELD_LOAD) \
+	(void)p; \
+	conn->recv_buf += MSG_LEN(name); \
+	conn->recv_len = 0; \
+	return proto_handle_##name(conn, &msg); \
+}
+SYNERGY_FIXED_MSGS(MSG_DECODER)
 
-	uint16_t ard_id = synergy_key_to_arduino(phys_id, id);
-	LOG(LOG_DEBUG_1, "key up (id=0x%x, phys_id=0x%x, mods=0x%.4x)", id, phys_id, mods);
+static int
+synergy_dispatch_pkt(struct synergy_proto_conn *conn, uint32_t tag)
+{
+#define MSG_DISPATCH(tag_str, name) \
+	if (tag == STR2TAG(tag_str)) { \
+		return decode_##name(conn); \
+	}
+	SYNERGY_FIXED_MSGS(MSG_DISPATCH)
+#undef MSG_DISPATCH
+
+	/* variable length */
+	if (tag == STR2TAG("DSOP")) {
+		return proto_handle_set_options(conn);
+	} else if (tag == STR2TAG("DCLP")) {
+		return proto_handle_clipboard_sync(conn);
+	}
+
+	LOG(LOG_INFO, "unknown pkt: %.4s (%d)", conn->recv_buf - 4, conn->recv_len + 4);
 
-	serial_ard_key_up(ard_id);
 	return 0;
 }
 
@@ -803,47 +911,159 @@ int
 synergy_handle_pkt(struct synergy_proto_conn *conn)
 {
 	uint32_t tag;
+	int rc;
 
 	assert(conn->recv_len >= 4);
 	tag = read_uint32(conn);
 
-	/* TODO binary search perhaps? */
-	if (tag == STR2TAG("QINF")) {
-		return proto_handle_qinf(conn);
-	} else if (tag == STR2TAG("CIAK")) {
-		return proto_handle_dummy(conn, 0);
-	} else if (tag == STR2TAG("CROP")) {
-		return proto_handle_dummy(conn, 0);
-	} else if (tag == STR2TAG("DSOP")) {
-		return proto_handle_set_options(conn);
-	} else if (tag == STR2TAG("CALV")) {
-		return proto_handle_keepalive(conn);
-	} else if (tag == STR2TAG("CINN")) {
-		return proto_handle_screen_enter(conn);
-	} else if (tag == STR2TAG("DCLP")) {
-		return proto_handle_clipboard_sync(conn);
-	} else if (tag == STR2TAG("COUT")) {
-		serial_ard_all_up();
-		return proto_handle_dummy(conn, 0);
-	} else if (tag == STR2TAG("DMMV")) {
-		return proto_handle_mouse_move(conn);
-	} else if (tag == STR2TAG("DMRM")) {
-		return proto_handle_rel_mouse_move(conn);
-	} else if (tag == STR2TAG("DMDN")) {
-		return proto_handle_mouse_down(conn);
-	} else if (tag == STR2TAG("DMUP")) {
-		return proto_handle_mouse_up(conn);
-	} else if (tag == STR2TAG("DMWM")) {
-		return proto_handle_mouse_wheel(conn);
-	} else if (tag == STR2TAG("DKDN")) {
-		return proto_handle_key_down(conn);
-	} else if (tag == STR2TAG("DKRP")) {
-		return proto_handle_dummy(conn, 8);
-	} else if (tag == STR2TAG("DKUP")) {
-		return proto_handle_key_up(conn);
+	TRACE_BEGIN(handle_pkt, tag);
+	rc = synergy_dispatch_pkt(conn, tag);
+	TRACE_END(handle_pkt, rc);
+
+	return rc;
+}
+
+/* 0 if a packet of this length can be handled, 1 if it has to be skipped */
+static inline int
+check_pkt_len(struct synergy_proto_conn *conn, uint32_t len)
+{
+	if (__builtin_expect(len >= 4 && len < SYNERGY_PROTO_MAX_PKT - 4, 1)) {
+		return 0;
 	}
 
-	LOG(LOG_INFO, "unknown pkt: %.4s (%d)", conn->recv_buf - 4, conn->recv_len + 4);
+	if (len >= 65536 - 4 || len < 4) {
+		/* we certainly screwed up somewhere */
+		LOG(LOG_ERROR, "recv invalid packet: pktlen=%"PRIu32, len);
+		return -EINVAL;
+	}
+
+	if (len >= SYNERGY_PROTO_MAX_PKT - 4) {
+		/* we don't support packets this big (like clipboard contents) */
+		LOG(LOG_ERROR, "recv too big packet: pktlen=%"PRIu32, len);
+		return 1;
+	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+static int
+handle_pkt_at(struct synergy_proto_conn *conn, const char *pkt, uint32_t len)
+{
+	int rc;
+
+	TRACE_INSTANT(pkt_reassemble, len);
+	conn->recv_buf = pkt + 4;
+	conn->recv_len = len;
+
+	if (__builtin_expect(!conn->greeted, 0)) {
+		rc = synergy_proto_handle_greeting(conn);
+		if (rc < 0) {
+			LOG(LOG_ERROR, "synergy_proto_handle_greeting() returned %d", rc);
+			return rc;
+		}
+		conn->greeted = true;
+		return 0;
+	}
+
+	rc = synergy_handle_pkt(conn);
+	conn->npkts++;
+	if (rc < 0) {
+		LOG(LOG_ERROR, "synergy_handle_pkt() returned %d", rc);
+	}
+	return rc;
+}
+
+int
+synergy_proto_push(struct synergy_proto_conn *conn, const void *buf, unsigned len)
+{
+	const char *p = buf;
+	uint32_t pktlen;
+	unsigned n;
+	int rc;
+
+	while (len > 0) {
+		if (conn->skip_nbytes > 0) {
+			n = conn->skip_nbytes < len ? conn->skip_nbytes : len;
+			conn->skip_nbytes -= n;
+			p += n;
+			len -= n;
+			continue;
+		}
+
+		if (conn->pkt_len > 0 || len < 4) {
+			/* complete the split packet in pkt_buf, header first */
+			bool had_hdr = conn->pkt_len >= 4;
+
+			if (!had_hdr) {
+				n = 4 - conn->pkt_len;
+			} else {
+				n = 4 + load_uint32_t((const uint8_t *)conn->pkt_buf) - conn->pkt_len;
+			}
+			n = n < len ? n : len;
+			memcpy(conn->pkt_buf + conn->pkt_len, p, n);
+			conn->pkt_len += n;
+			p += n;
+			len -= n;
+
+			if (conn->pkt_len < 4) {
+				continue;
+			}
+
+			pktlen = load_uint32_t((const uint8_t *)conn->pkt_buf);
+			if (!had_hdr) {
+				rc = check_pkt_len(conn, pktlen);
+				if (rc < 0) {
+					return rc;
+				} else if (rc > 0) {
+					conn->skip_nbytes = pktlen;
+					conn->pkt_len = 0;
+					continue;
+				}
+			}
+
+			if (conn->pkt_len < pktlen + 4) {
+				continue;
+			}
+
+			conn->pkt_len = 0;
+			rc = handle_pkt_at(conn, conn->pkt_buf, pktlen);
+			if (rc < 0) {
+				return rc;
+			}
+			continue;
+		}
+
+		/* usually, whole packets straight from the caller's buffer */
+		pktlen = load_uint32_t((const uint8_t *)p);
+		rc = check_pkt_len(conn, pktlen);
+		if (__builtin_expect(rc != 0, 0)) {
+			if (rc < 0) {
+				return rc;
+			}
+			conn->skip_nbytes = pktlen + 4;
+			continue;
+		}
+
+		if (pktlen + 4 > len) {
+			memcpy(conn->pkt_buf, p, len);
+			conn->pkt_len = len;
+			break;
+		}
+
+		rc = handle_pkt_at(conn, p, pktlen);
+		if (rc < 0) {
+			return rc;
+		}
+		p += pktlen + 4;
+		len -= pktlen + 4;
+	}
+
+	/* all responses to this push go out in a single send() */
+	rc = synergy_proto_flush(conn);
+	if (rc < 0) {
+		return rc;
+	}
+
+	/* and everything it carried for the sink as a single batch */
+	return sink_submit(conn->sink);
+}
@@ -2,21 +2,60 @@
  * Copyright(c) 2022 Darek Stojaczyk
  */
 
-#include <stdio.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+#ifndef SYNERGY_SERIAL_SYNERGY_PROTO
+#define SYNERGY_SERIAL_SYNERGY_PROTO
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Bigger packets (like clipboard contents) are skipped */
+#define SYNERGY_PROTO_MAX_PKT 2048
+
+struct sink;
+
+/* A single connection to the synergy server. Everything the protocol core
+ * needs is in here or in its sink, so any number of them can be driven at
+ * once. Zero-initialize, set the sink and send, then push everything
+ * received with synergy_proto_push(), starting with the greeting. The
+ * socket (and TLS, if any) stays with the caller.
+ */
 struct synergy_proto_conn {
-    int fd;
-    char *recv_buf;
+    struct sink *sink; /**< where the decoded input goes */
+    /** like send(), for the responses */
+    ssize_t (*send)(struct synergy_proto_conn *conn, const void *buf, size_t len);
+    void *ctx; /**< for whoever set send */
+
+    const char *recv_buf;
     int recv_len;
-    char resp_buf[512];
-    int resp_len;
+    unsigned resp_start; /**< offset of the response currently being written */
+    unsigned resp_len;
+    int resp_error; /**< non-zero if the current response didn't fit */
     int recv_error; /**< non-zero on receive error */
 
     uint16_t mouse_x, mouse_y;
+    bool skip_next_mouse_move;
+    bool greeted;
+    unsigned pkt_len; /**< how much of the split packet in pkt_buf we have */
+    unsigned skip_nbytes; /**< what's left of a packet that's too big */
+    uint64_t npkts; /**< handled so far, the greeting excepted */
+
+    /* the buffers last, so that the above share a few cache lines */
+    char resp_buf[4096]; /**< queued responses, each with its length prefix */
+    char pkt_buf[SYNERGY_PROTO_MAX_PKT]; /**< a packet split between pushes */
 };
 
+/** Handle a chunk of the stream received from the server: split it into
+ * packets (the last one may be completed by the next push), handle them,
+ * send out all their responses in one go, and submit everything they
+ * carried to the sink as a single batch. Returns 0 or negative errno;
+ * after an error the stream can't be trusted anymore. */
+int synergy_proto_push(struct synergy_proto_conn *conn, const void *buf, unsigned len);
+
+/* The same, one packet (without its length prefix) at a time, in recv_buf */
 int synergy_proto_handle_greeting(struct synergy_proto_conn *conn);
-int synergy_handle_pkt(struct synergy_proto_conn *conn);
\ No newline at end of file
+int synergy_handle_pkt(struct synergy_proto_conn *conn);
+/** Send out all responses queued by the handled packets in one go */
+int synergy_proto_flush(struct synergy_proto_conn *conn);
+
+#endif /* SYNERGY_SERIAL_SYNERGY_PROTO */
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+/* Example consumer of the synergy-serial --tap ring: prints the events as
+ * they come, and how many were lost by not keeping up. It only ever reads
+ * the shared memory, so it can't slow the client down.
+ *
+ *   ./build/tap-reader [-a] /synergy-tap
+ *
+ * -a starts from the oldest record still in the ring instead of the newest.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tap.h"
+#include "sink.h"
+
+static volatile sig_atomic_t g_stop;
+
+static const char *g_type_names[] = {
+	[SINK_EV_MOVE] = "move",
+	[SINK_EV_SET_POS] = "set_pos",
+	[SINK_EV_BUTTON] = "button",
+	[SINK_EV_WHEEL] = "wheel",
+	[SINK_EV_KEY] = "key",
+	[SINK_EV_KEY_REPEAT] = "key_repeat",
+	[SINK_EV_RELEASE_ALL] = "release_all",
+};
+
+static void
+handle_stop_signal(int signo)
+{
+	g_stop = 1;
+}
+
+/* copy out record idx; false if it's been (or is being) overwritten */
+static bool
+read_record(const struct tap_header *tap, uint64_t idx, struct tap_record *out)
+{
+	const struct tap_record *rec = &tap->records[idx % tap->nrecords];
+	uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+	if (seq != idx + 1) {
+		return false;
+	}
+
+	memcpy(out, rec, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static void
+print_record(const struct tap_record *rec)
+{
+	const char *name = rec->type < sizeof(g_type_names) / sizeof(g_type_names[0]) ?
+		g_type_names[rec->type] : "?";
+
+	switch (rec->type) {
+		case SINK_EV_MOVE:
+		case SINK_EV_WHEEL:
+			printf("%"PRIu64" %s %d %d", rec->ts_us, name, rec->arg1, rec->arg2);
+			break;
+		case SINK_EV_SET_POS:
+			printf("%"PRIu64" %s %u %u", rec->ts_us, name,
+					(uint16_t)rec->arg1, (uint16_t)rec->arg2);
+			break;
+		case SINK_EV_BUTTON:
+		case SINK_EV_KEY:
+			printf("%"PRIu64" %s 0x%x %s", rec->ts_us, name, rec->id,
+					rec->down ? "down" : "up");
+			break;
+		default:
+			printf("%"PRIu64" %s 0x%x", rec->ts_us, name, rec->id);
+			break;
+	}
+	printf(" out_seq=%"PRIu32"\n", rec->out_seq);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct tap_header *tap;
+	struct tap_record rec;
+	uint64_t pos, head, nread = 0, nlost = 0;
+	bool from_oldest = false;
+	struct stat st;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "a")) != -1) {
+		if (opt == 'a') {
+			from_oldest = true;
+		} else {
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "%s [-a] /shm-name\n", argv[0]);
+		return 1;
+	}
+
+	fd = shm_open(argv[optind], O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "can't open \"%s\": %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	tap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tap == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (__atomic_load_n(&tap->magic, __ATOMIC_ACQUIRE) != TAP_MAGIC ||
+			tap->version != TAP_VERSION || tap->record_size != sizeof(struct tap_record)) {
+		fprintf(stderr, "\"%s\" isn't a tap ring we know\n", argv[optind]);
+		return 1;
+	}
+
+	struct sigaction sa = { .sa_handler = handle_stop_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	head = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+	pos = head;
+	if (from_oldest) {
+		pos = head > tap->nrecords ? head - tap->nrecords : 0;
+	}
+
+	while (!g_stop) {
+		head = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+		if (pos == head) {
+			usleep(1000);
+			continue;
+		}
+
+		if (head - pos > tap->nrecords) {
+			/* lapped, those are gone */
+			nlost += head - pos - tap->nrecords;
+			pos = head - tap->nrecords;
+		}
+
+		for (; pos < head; pos++) {
+			if (!read_record(tap, pos, &rec)) {
+				/* overwritten while we got here */
+				nlost++;
+				continue;
+			}
+			print_record(&rec);
+			nread++;
+		}
+		fflush(stdout);
+	}
+
+	fprintf(stderr, "%"PRIu64" events read, %"PRIu64" lost\n", nread, nlost);
+	return 0;
+}
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tap.h"
+#include "sink.h"
+#include "clock.h"
+#include "config.h"
+#include "common.h"
+
+struct tap_header *g_tap;
+static const char *g_tap_name;
+static size_t g_tap_size;
+/* records written so far, published or not */
+static uint64_t g_tap_staged;
+/* a batch is usually a single recv(), so it gets a single timestamp */
+static uint64_t g_tap_batch_us;
+
+int
+tap_init(const char *name)
+{
+	size_t size = sizeof(struct tap_header) + CONFIG_TAP_RECORDS * sizeof(struct tap_record);
+	struct tap_header *hdr;
+	int fd, rc;
+
+	/* a reader still attached to an old one keeps its own copy */
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		rc = -errno;
+		LOG(LOG_ERROR, "shm_open(\"%s\"): %s", name, strerror(errno));
+		return rc;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		rc = -errno;
+		LOG(LOG_ERROR, "ftruncate(\"%s\", %zu): %s", name, size, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return rc;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		rc = -errno;
+		LOG(LOG_ERROR, "mmap(\"%s\"): %s", name, strerror(errno));
+		shm_unlink(name);
+		return rc;
+	}
+
+	/* it's all zeroes, so no record looks published yet */
+	hdr->version = TAP_VERSION;
+	hdr->record_size = sizeof(struct tap_record);
+	hdr->nrecords = CONFIG_TAP_RECORDS;
+	__atomic_store_n(&hdr->magic, TAP_MAGIC, __ATOMIC_RELEASE);
+
+	g_tap_name = name;
+	g_tap_size = size;
+	g_tap_staged = 0;
+	g_tap = hdr;
+	LOG(LOG_INFO, "event tap at shm \"%s\", %u records", name, CONFIG_TAP_RECORDS);
+	return 0;
+}
+
+void
+tap_fini(void)
+{
+	if (!g_tap) {
+		return;
+	}
+
+	munmap(g_tap, g_tap_size);
+	shm_unlink(g_tap_name);
+	g_tap = NULL;
+}
+
+void
+tap_stage(const struct sink_event *ev)
+{
+	struct tap_record *rec = &g_tap->records[g_tap_staged % CONFIG_TAP_RECORDS];
+
+	/* whoever's still reading the record overwritten here will know */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (g_tap_staged == g_tap->head) {
+		g_tap_batch_us = clock_now_us();
+	}
+	rec->ts_us = g_tap_batch_us;
+	rec->type = ev->type;
+	rec->down = ev->down;
+	rec->id = ev->id;
+	rec->arg1 = ev->dx;
+	rec->arg2 = ev->dy;
+	g_tap_staged++;
+}
+
+void
+tap_publish(uint64_t out_seq)
+{
+	uint64_t i;
+
+	for (i = g_tap->head; i < g_tap_staged; i++) {
+		struct tap_record *rec = &g_tap->records[i % CONFIG_TAP_RECORDS];
+
+		rec->out_seq = out_seq;
+		__atomic_store_n(&rec->seq, i + 1, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&g_tap->head, g_tap_staged, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_TAP
+#define SYNERGY_SERIAL_TAP
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A copy of every decoded input event, in a ring in a named shared memory
+ * object (--tap), for other processes to read. There's a single writer
+ * and it never waits for the readers: it just keeps overwriting the oldest
+ * records, and a reader that falls behind by more than the ring skips
+ * ahead. See tap-reader.c for how to read it.
+ *
+ * Each record is published seqlock style. The writer zeroes its seq,
+ * fills it in, then stores seq = index + 1 (with release semantics), and
+ * finally bumps the header's head. A reader loads seq (acquire), copies
+ * the record, and loads seq again after an acquire fence; the copy is
+ * good if both are index + 1.
+ */
+#define TAP_MAGIC 0x50415453 /* "STAP" */
+#define TAP_VERSION 1
+
+struct tap_record {
+	uint64_t seq; /**< index + 1 once written, 0 while being written */
+	uint64_t ts_us; /**< when its batch started being decoded, CLOCK_MONOTONIC
+			 * (or the simulated clock) */
+	uint32_t out_seq; /**< the sink's messages so far once the event's batch was
+			   * committed; the ones carrying it are at or before it, unless
+			   * it's a move merged for a later tick */
+	uint8_t type; /**< enum sink_event_type, see sink.h */
+	uint8_t down;
+	uint16_t id; /**< button bits or HID usage */
+	int16_t arg1; /**< dx or x (as uint16_t) */
+	int16_t arg2; /**< dy or y (as uint16_t) */
+	uint32_t reserved;
+};
+
+struct tap_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t nrecords; /**< a power of two; record i is at i % nrecords */
+	uint32_t reserved;
+	uint64_t head; /**< records published so far */
+	uint8_t pad[40];
+	struct tap_record records[];
+};
+
+struct sink_event;
+
+extern struct tap_header *g_tap;
+
+/** Create (or replace) the shm object with the given name, e.g. "/synergy-tap" */
+int tap_init(const char *name);
+/** Unmap and unlink it */
+void tap_fini(void);
+/** Write a record for the event, but don't publish it yet */
+void tap_stage(const struct sink_event *ev);
+/** Publish everything staged, with the sink's current message count */
+void tap_publish(uint64_t out_seq);
+
+#define TAP_STAGE(ev) \
+({ \
+	if (__builtin_expect(g_tap != NULL, 0)) { \
+		tap_stage((ev)); \
+	} \
+})
+
+#define TAP_PUBLISH(out_seq) \
+({ \
+	if (__builtin_expect(g_tap != NULL, 0)) { \
+		tap_publish((out_seq)); \
+	} \
+})
+
+#endif /* SYNERGY_SERIAL_TAP */
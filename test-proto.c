@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+/* Pushes malformed streams through the protocol core, which must refuse
+ * them instead of crashing. Exits non-zero on failure.
+ *
+ *   ./build/test-proto
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "synergy_proto.h"
+#include "sink.h"
+#include "common.h"
+
+static int
+nop_move(struct sink *sink, int16_t dx, int16_t dy)
+{
+	return 0;
+}
+
+static int
+nop_set_pos(struct sink *sink, uint16_t x, uint16_t y)
+{
+	return 0;
+}
+
+static int
+nop_button(struct sink *sink, uint8_t id, bool down)
+{
+	return 0;
+}
+
+static int
+nop_key(struct sink *sink, uint16_t id, bool down)
+{
+	return 0;
+}
+
+static int
+nop_sink(struct sink *sink)
+{
+	return 0;
+}
+
+static const struct sink_ops g_nop_sink_ops = {
+	.move = nop_move,
+	.set_pos = nop_set_pos,
+	.button = nop_button,
+	.wheel = nop_move,
+	.key = nop_key,
+	.release_all = nop_sink,
+	.flush = nop_sink,
+};
+
+static ssize_t
+nop_send(struct synergy_proto_conn *conn, const void *buf, size_t len)
+{
+	return len;
+}
+
+static const char g_greeting[] = "\0\0\0\x0bSynergy\0\x01\0\x06";
+
+/* a fresh connection past the greeting gets stream, split in pushes of
+ * split bytes; the push must fail with -EINVAL */
+static int
+expect_einval(const char *name, const void *stream, unsigned len, unsigned split)
+{
+	static struct synergy_proto_conn conn;
+	static struct sink sink;
+	unsigned off, n;
+	int rc = 0;
+
+	memset(&conn, 0, sizeof(conn));
+	memset(&sink, 0, sizeof(sink));
+	sink.name = "nop";
+	sink.ops = &g_nop_sink_ops;
+	conn.sink = &sink;
+	conn.send = nop_send;
+
+	rc = synergy_proto_push(&conn, g_greeting, sizeof(g_greeting) - 1);
+	if (rc < 0) {
+		fprintf(stderr, "%s: the greeting returned %d\n", name, rc);
+		return 1;
+	}
+
+	for (off = 0; off < len && rc == 0; off += n) {
+		n = len - off < split ? len - off : split;
+		rc = synergy_proto_push(&conn, (const char *)stream + off, n);
+	}
+
+	if (rc != -EINVAL) {
+		fprintf(stderr, "%s: push returned %d, expected %d\n", name, rc, -EINVAL);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	/* the length plus its own 4 bytes doesn't fit in 32 bits */
+	static const char huge[] = "\xff\xff\xff\xff" "CALV";
+	static const char wraps[] = "\xff\xff\xff\xfc" "CALV";
+	int rc = 0;
+
+	g_log_level = LOG_ERROR;
+	rc |= expect_einval("0xffffffff header", huge, sizeof(huge) - 1, UINT32_MAX);
+	rc |= expect_einval("0xffffffff header, split", huge, sizeof(huge) - 1, 1);
+	rc |= expect_einval("0xfffffffc header", wraps, sizeof(wraps) - 1, UINT32_MAX);
+	rc |= expect_einval("0xfffffffc header, split", wraps, sizeof(wraps) - 1, 1);
+
+	printf("test-proto: %s\n", rc ? "FAILED" : "ok");
+	return rc;
+}
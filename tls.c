@@ -0,0 +1,317 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "tls.h"
+#include "common.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define TLS_RECORD_TYPE_ALERT 21
+#define TLS_RECORD_TYPE_HANDSHAKE 22
+#define TLS_RECORD_TYPE_DATA 23
+
+static SSL_CTX *g_ctx;
+static SSL *g_ssl;
+static bool g_ktls_recv, g_ktls_send;
+
+static void
+log_ssl_error(const char *what)
+{
+	unsigned long err = ERR_get_error();
+	char buf[256];
+
+	ERR_error_string_n(err, buf, sizeof(buf));
+	LOG(LOG_ERROR, "%s: %s", what, err ? buf : strerror(errno));
+	ERR_clear_error();
+}
+
+/* lowercase hex digits only, so any "AA:BB:.." form compares equal */
+static void
+normalize_fingerprint(const char *in, char *out, size_t outlen)
+{
+	size_t n = 0;
+
+	for (; *in && n + 1 < outlen; in++) {
+		if (isxdigit((unsigned char)*in)) {
+			out[n++] = tolower((unsigned char)*in);
+		}
+	}
+	out[n] = 0;
+}
+
+static int
+check_fingerprint(const char *fingerprint)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	char actual[EVP_MAX_MD_SIZE * 3], pinned[EVP_MAX_MD_SIZE * 2 + 1];
+	char actual_hex[EVP_MAX_MD_SIZE * 2 + 1];
+	unsigned mdlen, i;
+	X509 *cert;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	cert = SSL_get1_peer_certificate(g_ssl);
+#else
+	cert = SSL_get_peer_certificate(g_ssl);
+#endif
+	if (!cert) {
+		LOG(LOG_ERROR, "the server didn't present a certificate");
+		return -EACCES;
+	}
+
+	if (!X509_digest(cert, EVP_sha256(), md, &mdlen)) {
+		X509_free(cert);
+		log_ssl_error("X509_digest");
+		return -EINVAL;
+	}
+	X509_free(cert);
+
+	for (i = 0; i < mdlen; i++) {
+		sprintf(actual + i * 3, "%02X%s", md[i], i + 1 < mdlen ? ":" : "");
+	}
+
+	normalize_fingerprint(actual, actual_hex, sizeof(actual_hex));
+	normalize_fingerprint(fingerprint, pinned, sizeof(pinned));
+	if (strcmp(actual_hex, pinned) != 0) {
+		LOG(LOG_ERROR, "server certificate fingerprint mismatch, got SHA256 %s", actual);
+		return -EACCES;
+	}
+
+	LOG(LOG_INFO, "server certificate fingerprint SHA256 %s", actual);
+	return 0;
+}
+
+int
+tls_connect(int fd, const char *fingerprint)
+{
+	int rc;
+
+	g_ctx = SSL_CTX_new(TLS_client_method());
+	if (!g_ctx) {
+		log_ssl_error("SSL_CTX_new");
+		return -ENOMEM;
+	}
+
+	SSL_CTX_set_min_proto_version(g_ctx, TLS1_2_VERSION);
+	/* it's the pinned fingerprint we trust, not any CA */
+	SSL_CTX_set_verify(g_ctx, SSL_VERIFY_NONE, NULL);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(g_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	g_ssl = SSL_new(g_ctx);
+	if (!g_ssl || !SSL_set_fd(g_ssl, fd)) {
+		log_ssl_error("SSL_new");
+		tls_fini();
+		return -ENOMEM;
+	}
+
+	rc = SSL_connect(g_ssl);
+	if (rc != 1) {
+		log_ssl_error("TLS handshake");
+		tls_fini();
+		return -ECONNREFUSED;
+	}
+
+	rc = check_fingerprint(fingerprint);
+	if (rc < 0) {
+		tls_fini();
+		return rc;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	g_ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(g_ssl));
+	g_ktls_send = BIO_get_ktls_send(SSL_get_wbio(g_ssl));
+#endif
+	LOG(LOG_INFO, "%s (%s), kTLS rx: %s, tx: %s", SSL_get_version(g_ssl),
+			SSL_get_cipher_name(g_ssl), g_ktls_recv ? "yes" : "no",
+			g_ktls_send ? "yes" : "no");
+	return 0;
+}
+
+void
+tls_fini(void)
+{
+	if (g_ssl) {
+		SSL_free(g_ssl);
+		g_ssl = NULL;
+	}
+	if (g_ctx) {
+		SSL_CTX_free(g_ctx);
+		g_ctx = NULL;
+	}
+	g_ktls_recv = g_ktls_send = false;
+}
+
+/* The kernel hands out non-data records (session tickets, key updates,
+ * alerts) one at a time, and only with a cmsg saying what they are. */
+static ssize_t
+ktls_recv(int fd, void *buf, size_t len, int flags)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	unsigned char record_type;
+	ssize_t rc;
+
+	while (1) {
+		msg.msg_controllen = sizeof(cbuf);
+		rc = recvmsg(fd, &msg, flags);
+		if (rc < 0) {
+			return rc;
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_level != SOL_TLS || cmsg->cmsg_type != TLS_GET_RECORD_TYPE) {
+			return rc;
+		}
+
+		record_type = *(unsigned char *)CMSG_DATA(cmsg);
+		if (record_type == TLS_RECORD_TYPE_DATA) {
+			return rc;
+		} else if (record_type == TLS_RECORD_TYPE_ALERT) {
+			LOG(LOG_ERROR, "TLS alert from the server");
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		/* post-handshake messages; nothing we'd act upon */
+		LOG(LOG_DEBUG_1, "ignoring TLS record type %u", record_type);
+	}
+}
+
+ssize_t
+tls_recv(int fd, void *buf, size_t len, int flags)
+{
+	int rc;
+
+	if (!g_ssl) {
+		return recv(fd, buf, len, flags);
+	} else if (g_ktls_recv) {
+		return ktls_recv(fd, buf, len, flags);
+	}
+
+	if ((flags & MSG_DONTWAIT) && !SSL_pending(g_ssl)) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		/* this still blocks if only a part of a record is there yet, but
+		 * the rest of it is at most a few packets behind */
+		if (poll(&pfd, 1, 0) == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	rc = SSL_read(g_ssl, buf, len);
+	if (rc > 0) {
+		return rc;
+	}
+
+	switch (SSL_get_error(g_ssl, rc)) {
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0) {
+				/* EOF without close_notify */
+				return 0;
+			}
+			return -1;
+		default:
+			log_ssl_error("SSL_read");
+			errno = EIO;
+			return -1;
+	}
+}
+
+ssize_t
+tls_send(int fd, const void *buf, size_t len, int flags)
+{
+	int rc;
+
+	if (!g_ssl) {
+		return send(fd, buf, len, flags);
+	} else if (g_ktls_send) {
+		return send(fd, buf, len, flags);
+	}
+
+	rc = SSL_write(g_ssl, buf, len);
+	if (rc > 0) {
+		return rc;
+	}
+
+	switch (SSL_get_error(g_ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			return -1;
+		default:
+			log_ssl_error("SSL_write");
+			errno = EIO;
+			return -1;
+	}
+}
+
+bool
+tls_pending(void)
+{
+	return g_ssl && !g_ktls_recv && SSL_pending(g_ssl) > 0;
+}
+
+#else /* HAVE_OPENSSL */
+
+int
+tls_connect(int fd, const char *fingerprint)
+{
+	LOG(LOG_ERROR, "built without OpenSSL, TLS is not available");
+	return -ENOTSUP;
+}
+
+void
+tls_fini(void)
+{
+}
+
+ssize_t
+tls_recv(int fd, void *buf, size_t len, int flags)
+{
+	return recv(fd, buf, len, flags);
+}
+
+ssize_t
+tls_send(int fd, const void *buf, size_t len, int flags)
+{
+	return send(fd, buf, len, flags);
+}
+
+bool
+tls_pending(void)
+{
+	return false;
+}
+
+#endif /* HAVE_OPENSSL */
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_TLS
+#define SYNERGY_SERIAL_TLS
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/** Do a TLS handshake on the connected socket and check that the server
+ * certificate's SHA-256 matches the given fingerprint (hex, colons optional).
+ * Record processing is then handed over to the kernel whenever possible. */
+int tls_connect(int fd, const char *fingerprint);
+void tls_fini(void);
+
+/* Those behave just like recv()/send(), decrypting/encrypting the data if
+ * TLS is up. With kTLS they're just a recv()/send() on the socket. */
+ssize_t tls_recv(int fd, void *buf, size_t len, int flags);
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags);
+
+/** Is there already decrypted data that poll() on the socket won't tell about */
+bool tls_pending(void);
+
+#endif /* SYNERGY_SERIAL_TLS */
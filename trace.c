@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "common.h"
+#include "clock.h"
+
+bool g_trace_enabled = false;
+
+struct trace_rec {
+	uint64_t ts_ns;
+	const char *name;
+	uint32_t arg;
+	char phase;
+};
+
+static FILE *g_trace_file;
+static struct trace_rec g_trace_recs[4096];
+static unsigned g_trace_nrecs;
+static int g_trace_pid;
+
+static void
+trace_flush(void)
+{
+	unsigned i;
+
+	for (i = 0; i < g_trace_nrecs; i++) {
+		struct trace_rec *rec = &g_trace_recs[i];
+
+		/* the JSON array format doesn't require the closing bracket, so
+		 * the trace stays loadable even if we never get to trace_fini() */
+		fprintf(g_trace_file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%"PRIu64".%03u,"
+				"\"pid\":%d,\"tid\":%d,%s\"args\":{\"arg\":%"PRIu32"}},\n",
+				rec->name, rec->phase, rec->ts_ns / 1000, (unsigned)(rec->ts_ns % 1000),
+				g_trace_pid, g_trace_pid, rec->phase == 'i' ? "\"s\":\"t\"," : "",
+				rec->arg);
+	}
+
+	g_trace_nrecs = 0;
+	fflush(g_trace_file);
+}
+
+void
+trace_event(const char *name, char phase, uint32_t arg)
+{
+	struct trace_rec *rec;
+
+	if (!g_trace_file) {
+		return;
+	}
+
+	rec = &g_trace_recs[g_trace_nrecs++];
+	rec->ts_ns = clock_now_ns();
+	rec->name = name;
+	rec->arg = arg;
+	rec->phase = phase;
+
+	if (g_trace_nrecs == sizeof(g_trace_recs) / sizeof(g_trace_recs[0])) {
+		trace_flush();
+	}
+}
+
+int
+trace_init(const char *path)
+{
+	g_trace_file = fopen(path, "w");
+	if (!g_trace_file) {
+		LOG(LOG_ERROR, "Can't open trace file at \"%s\": %s", path, strerror(errno));
+		return -errno;
+	}
+
+	g_trace_pid = getpid();
+	fprintf(g_trace_file, "[\n");
+	g_trace_enabled = true;
+	return 0;
+}
+
+void
+trace_fini(void)
+{
+	if (!g_trace_file) {
+		return;
+	}
+
+	trace_flush();
+	g_trace_enabled = false;
+
+	/* close the array with an empty event to consume the trailing comma */
+	fprintf(g_trace_file, "{}]\n");
+	fclose(g_trace_file);
+	g_trace_file = NULL;
+}
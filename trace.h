@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_TRACE
+#define SYNERGY_SERIAL_TRACE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Static USDT probes (provider "synergy_serial"). Those are just nops unless
+ * someone attaches to them with bpftrace/perf/systemtap. Without sys/sdt.h
+ * they compile to nothing at all.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT(probe, arg) DTRACE_PROBE1(synergy_serial, probe, arg)
+#endif
+#endif
+
+#ifndef TRACE_USDT
+#define TRACE_USDT(probe, arg) do { (void)(arg); } while (0)
+#endif
+
+extern bool g_trace_enabled;
+
+/** Start recording Chrome/Perfetto JSON trace events to the given file */
+int trace_init(const char *path);
+/** Flush any buffered events and close the trace file */
+void trace_fini(void);
+void trace_event(const char *name, char phase, uint32_t arg);
+
+#define TRACE_EVENT(name, phase, probe, arg) \
+({ \
+	TRACE_USDT(probe, (arg)); \
+	if (__builtin_expect(g_trace_enabled, 0)) { \
+		trace_event((name), (phase), (arg)); \
+	} \
+})
+
+#define TRACE_BEGIN(name, arg) TRACE_EVENT(#name, 'B', name ## __begin, (arg))
+#define TRACE_END(name, arg) TRACE_EVENT(#name, 'E', name ## __end, (arg))
+#define TRACE_INSTANT(name, arg) TRACE_EVENT(#name, 'i', name, (arg))
+
+#endif /* SYNERGY_SERIAL_TRACE */
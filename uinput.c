@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include "uinput.h"
+#include "absmap.h"
+#include "config.h"
+#include "common.h"
+
+static int g_kbd_fd = -1;
+static int g_mouse_fd = -1;
+static uint16_t g_hid_x, g_hid_y;
+static int32_t g_wheel_x, g_wheel_y;
+
+/* HID keyboard usage -> evdev keycode, the same as the kernel's hid-input */
+static const uint16_t g_hid_to_evdev[256] = {
+	[0x04] = KEY_A, [0x05] = KEY_B, [0x06] = KEY_C, [0x07] = KEY_D,
+	[0x08] = KEY_E, [0x09] = KEY_F, [0x0A] = KEY_G, [0x0B] = KEY_H,
+	[0x0C] = KEY_I, [0x0D] = KEY_J, [0x0E] = KEY_K, [0x0F] = KEY_L,
+	[0x10] = KEY_M, [0x11] = KEY_N, [0x12] = KEY_O, [0x13] = KEY_P,
+	[0x14] = KEY_Q, [0x15] = KEY_R, [0x16] = KEY_S, [0x17] = KEY_T,
+	[0x18] = KEY_U, [0x19] = KEY_V, [0x1A] = KEY_W, [0x1B] = KEY_X,
+	[0x1C] = KEY_Y, [0x1D] = KEY_Z, [0x1E] = KEY_1, [0x1F] = KEY_2,
+	[0x20] = KEY_3, [0x21] = KEY_4, [0x22] = KEY_5, [0x23] = KEY_6,
+	[0x24] = KEY_7, [0x25] = KEY_8, [0x26] = KEY_9, [0x27] = KEY_0,
+	[0x28] = KEY_ENTER, [0x29] = KEY_ESC, [0x2A] = KEY_BACKSPACE, [0x2B] = KEY_TAB,
+	[0x2C] = KEY_SPACE, [0x2D] = KEY_MINUS, [0x2E] = KEY_EQUAL, [0x2F] = KEY_LEFTBRACE,
+	[0x30] = KEY_RIGHTBRACE, [0x31] = KEY_BACKSLASH, [0x32] = KEY_BACKSLASH, [0x33] = KEY_SEMICOLON,
+	[0x34] = KEY_APOSTROPHE, [0x35] = KEY_GRAVE, [0x36] = KEY_COMMA, [0x37] = KEY_DOT,
+	[0x38] = KEY_SLASH, [0x39] = KEY_CAPSLOCK, [0x3A] = KEY_F1, [0x3B] = KEY_F2,
+	[0x3C] = KEY_F3, [0x3D] = KEY_F4, [0x3E] = KEY_F5, [0x3F] = KEY_F6,
+	[0x40] = KEY_F7, [0x41] = KEY_F8, [0x42] = KEY_F9, [0x43] = KEY_F10,
+	[0x44] = KEY_F11, [0x45] = KEY_F12, [0x46] = KEY_SYSRQ, [0x47] = KEY_SCROLLLOCK,
+	[0x48] = KEY_PAUSE, [0x49] = KEY_INSERT, [0x4A] = KEY_HOME, [0x4B] = KEY_PAGEUP,
+	[0x4C] = KEY_DELETE, [0x4D] = KEY_END, [0x4E] = KEY_PAGEDOWN, [0x4F] = KEY_RIGHT,
+	[0x50] = KEY_LEFT, [0x51] = KEY_DOWN, [0x52] = KEY_UP, [0x53] = KEY_NUMLOCK,
+	[0x54] = KEY_KPSLASH, [0x55] = KEY_KPASTERISK, [0x56] = KEY_KPMINUS, [0x57] = KEY_KPPLUS,
+	[0x58] = KEY_KPENTER, [0x59] = KEY_KP1, [0x5A] = KEY_KP2, [0x5B] = KEY_KP3,
+	[0x5C] = KEY_KP4, [0x5D] = KEY_KP5, [0x5E] = KEY_KP6, [0x5F] = KEY_KP7,
+	[0x60] = KEY_KP8, [0x61] = KEY_KP9, [0x62] = KEY_KP0, [0x63] = KEY_KPDOT,
+	[0x64] = KEY_102ND, [0x65] = KEY_COMPOSE, [0x66] = KEY_POWER, [0x67] = KEY_KPEQUAL,
+	[0x68] = KEY_F13, [0x69] = KEY_F14, [0x6A] = KEY_F15, [0x6B] = KEY_F16,
+	[0x6C] = KEY_F17, [0x6D] = KEY_F18, [0x6E] = KEY_F19, [0x6F] = KEY_F20,
+	[0x70] = KEY_F21, [0x71] = KEY_F22, [0x72] = KEY_F23, [0x73] = KEY_F24,
+	[0x74] = KEY_OPEN, [0x75] = KEY_HELP, [0x76] = KEY_PROPS, [0x77] = KEY_FRONT,
+	[0x78] = KEY_STOP, [0x79] = KEY_AGAIN, [0x7A] = KEY_UNDO, [0x7B] = KEY_CUT,
+	[0x7C] = KEY_COPY, [0x7D] = KEY_PASTE, [0x7E] = KEY_FIND, [0x7F] = KEY_MUTE,
+	[0x80] = KEY_VOLUMEUP, [0x81] = KEY_VOLUMEDOWN,
+	[0xE0] = KEY_LEFTCTRL, [0xE1] = KEY_LEFTSHIFT, [0xE2] = KEY_LEFTALT, [0xE3] = KEY_LEFTMETA,
+	[0xE4] = KEY_RIGHTCTRL, [0xE5] = KEY_RIGHTSHIFT, [0xE6] = KEY_RIGHTALT, [0xE7] = KEY_RIGHTMETA,
+};
+
+/* HID button bits, as in synergy_mouse_btn_to_arduino() */
+static const uint16_t g_buttons[] = { BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, BTN_SIDE, BTN_EXTRA };
+
+static int
+emit(int fd, uint16_t type, uint16_t code, int32_t value)
+{
+	struct input_event ev = { .type = type, .code = code, .value = value };
+
+	g_uinput_sink.nwrites++;
+	g_uinput_sink.nmsgs++;
+	if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+		LOG(LOG_ERROR, "uinput write: %s", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int
+emit_pos(void)
+{
+	emit(g_mouse_fd, EV_ABS, ABS_X, g_hid_x);
+	emit(g_mouse_fd, EV_ABS, ABS_Y, g_hid_y);
+	return emit(g_mouse_fd, EV_SYN, SYN_REPORT, 0);
+}
+
+static int
+uinput_sink_set_pos(struct sink *sink, uint16_t x, uint16_t y)
+{
+	absmap_point(x, y, &g_hid_x, &g_hid_y);
+	return emit_pos();
+}
+
+static int
+uinput_sink_move(struct sink *sink, int16_t dx, int16_t dy)
+{
+	int16_t hid_dx, hid_dy;
+	int32_t x, y;
+
+	/* it's an absolute device, so move relative to where we've been */
+	absmap_delta(dx, dy, &hid_dx, &hid_dy);
+	x = g_hid_x + hid_dx;
+	y = g_hid_y + hid_dy;
+	g_hid_x = x < 0 ? 0 : (x > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : x);
+	g_hid_y = y < 0 ? 0 : (y > ABSMAP_HID_MAX ? ABSMAP_HID_MAX : y);
+	return emit_pos();
+}
+
+static int
+uinput_sink_button(struct sink *sink, uint8_t id, bool down)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(g_buttons) / sizeof(g_buttons[0]); i++) {
+		if (id & (1 << i)) {
+			emit(g_mouse_fd, EV_KEY, g_buttons[i], down);
+		}
+	}
+
+	return emit(g_mouse_fd, EV_SYN, SYN_REPORT, 0);
+}
+
+static int
+uinput_sink_wheel(struct sink *sink, int16_t dx, int16_t dy)
+{
+	/* the hi-res axes take the raw deltas as they are, the legacy ones
+	 * need whole notches */
+	g_wheel_x += dx;
+	g_wheel_y += dy;
+
+	if (dy) {
+		emit(g_mouse_fd, EV_REL, REL_WHEEL_HI_RES, dy);
+	}
+	if (g_wheel_y / CONFIG_WHEEL_DELTA_PER_NOTCH) {
+		emit(g_mouse_fd, EV_REL, REL_WHEEL, g_wheel_y / CONFIG_WHEEL_DELTA_PER_NOTCH);
+		g_wheel_y %= CONFIG_WHEEL_DELTA_PER_NOTCH;
+	}
+
+	if (dx) {
+		emit(g_mouse_fd, EV_REL, REL_HWHEEL_HI_RES, dx);
+	}
+	if (g_wheel_x / CONFIG_WHEEL_DELTA_PER_NOTCH) {
+		emit(g_mouse_fd, EV_REL, REL_HWHEEL, g_wheel_x / CONFIG_WHEEL_DELTA_PER_NOTCH);
+		g_wheel_x %= CONFIG_WHEEL_DELTA_PER_NOTCH;
+	}
+
+	return emit(g_mouse_fd, EV_SYN, SYN_REPORT, 0);
+}
+
+static int
+uinput_sink_key(struct sink *sink, uint16_t id, bool down)
+{
+	if (id >= sizeof(g_hid_to_evdev) / sizeof(g_hid_to_evdev[0]) || !g_hid_to_evdev[id]) {
+		LOG(LOG_DEBUG_1, "no evdev mapping for key 0x%x", id);
+		return 0;
+	}
+
+	emit(g_kbd_fd, EV_KEY, g_hid_to_evdev[id], down);
+	return emit(g_kbd_fd, EV_SYN, SYN_REPORT, 0);
+}
+
+static int
+uinput_sink_key_repeat(struct sink *sink, uint16_t id)
+{
+	/* let the local input stack do the repeating, just like for
+	 * a real keyboard */
+	return 0;
+}
+
+static int
+uinput_sink_release_all(struct sink *sink)
+{
+	return 0;
+}
+
+static int
+uinput_sink_flush(struct sink *sink)
+{
+	/* everything is injected right away */
+	return 0;
+}
+
+static const struct sink_ops g_uinput_sink_ops = {
+	.move = uinput_sink_move,
+	.set_pos = uinput_sink_set_pos,
+	.button = uinput_sink_button,
+	.wheel = uinput_sink_wheel,
+	.key = uinput_sink_key,
+	.key_repeat = uinput_sink_key_repeat,
+	.release_all = uinput_sink_release_all,
+	.flush = uinput_sink_flush,
+};
+
+struct sink g_uinput_sink = {
+	.name = "uinput",
+	.ops = &g_uinput_sink_ops,
+};
+
+static int
+create_device(const char *name, int (*setup)(int fd))
+{
+	struct uinput_setup usetup = {
+		.id = { .bustype = BUS_VIRTUAL, .vendor = 0x1209, .product = 0x5359 },
+	};
+	int fd, rc;
+
+	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		LOG(LOG_ERROR, "Can't open /dev/uinput: %s", strerror(errno));
+		return -errno;
+	}
+
+	rc = setup(fd);
+	if (rc < 0) {
+		close(fd);
+		return rc;
+	}
+
+	snprintf(usetup.name, sizeof(usetup.name), "%s", name);
+	if (ioctl(fd, UI_DEV_SETUP, &usetup) != 0 || ioctl(fd, UI_DEV_CREATE) != 0) {
+		LOG(LOG_ERROR, "Can't create uinput device \"%s\": %s", name, strerror(errno));
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+static int
+setup_keyboard(int fd)
+{
+	unsigned i;
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	/* have the kernel auto-repeat held keys */
+	ioctl(fd, UI_SET_EVBIT, EV_REP);
+	for (i = 0; i < sizeof(g_hid_to_evdev) / sizeof(g_hid_to_evdev[0]); i++) {
+		if (g_hid_to_evdev[i] && ioctl(fd, UI_SET_KEYBIT, g_hid_to_evdev[i]) != 0) {
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+static int
+setup_mouse(int fd)
+{
+	struct uinput_abs_setup abs = {
+		.absinfo = { .minimum = 0, .maximum = ABSMAP_HID_MAX },
+	};
+	unsigned i;
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	for (i = 0; i < sizeof(g_buttons) / sizeof(g_buttons[0]); i++) {
+		ioctl(fd, UI_SET_KEYBIT, g_buttons[i]);
+	}
+
+	ioctl(fd, UI_SET_EVBIT, EV_REL);
+	ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+	ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+	ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+	ioctl(fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES);
+
+	ioctl(fd, UI_SET_EVBIT, EV_ABS);
+	abs.code = ABS_X;
+	if (ioctl(fd, UI_SET_ABSBIT, ABS_X) != 0 || ioctl(fd, UI_ABS_SETUP, &abs) != 0) {
+		return -errno;
+	}
+	abs.code = ABS_Y;
+	if (ioctl(fd, UI_SET_ABSBIT, ABS_Y) != 0 || ioctl(fd, UI_ABS_SETUP, &abs) != 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+int
+uinput_init(void)
+{
+	absmap_init();
+
+	g_kbd_fd = create_device("synergy-serial keyboard", setup_keyboard);
+	if (g_kbd_fd < 0) {
+		return g_kbd_fd;
+	}
+
+	g_mouse_fd = create_device("synergy-serial mouse", setup_mouse);
+	if (g_mouse_fd < 0) {
+		close(g_kbd_fd);
+		return g_mouse_fd;
+	}
+
+	return 0;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk
+ */
+
+#ifndef SYNERGY_SERIAL_UINPUT
+#define SYNERGY_SERIAL_UINPUT
+
+#include "sink.h"
+
+/** Create the local keyboard and absolute mouse devices */
+int uinput_init(void);
+
+/** The sink injecting events into the local uinput devices */
+extern struct sink g_uinput_sink;
+
+#endif /* SYNERGY_SERIAL_UINPUT */